@@ -0,0 +1,162 @@
+#include "vigor/line_scanner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+// Generates a large file of random text and reports how fast each of the
+// newline scanners gets through it, on every path the CPU supports.
+//
+// Usage: line_scanner_bench [size in MiB] [path]
+
+// Every measurement is the best of this many runs
+static const int runs = 5;
+
+static const char *scan_path_name(ScanPath path) {
+    switch (path) {
+    case SSE2Scan:
+        return "sse2";
+    case AVX2Scan:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+// Lines of anywhere from empty to a couple of hundred bytes, so the branchy
+// parts of the scanners get a workout too. Every fourth one ends in CRLF.
+static bool write_synthetic_file(const std::string &path, size_t size) {
+    std::ofstream file(path, std::ios::binary);
+
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::mt19937 rng(1);
+    std::string line;
+    size_t written = 0;
+
+    while (written < size) {
+        line.assign(rng() % 200, ' ');
+
+        for (char &c : line) {
+            c = ' ' + rng() % 95;
+        }
+
+        line += rng() % 4 == 0 ? "\r\n" : "\n";
+        line.resize(std::min(line.size(), size - written));
+
+        file.write(line.data(), line.size());
+        written += line.size();
+    }
+
+    return file.good();
+}
+
+// Runs `fn` a few times and returns the best throughput in GB/s
+template <typename Fn>
+static double measure(size_t bytes, Fn fn) {
+    double best = 0.0;
+
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+        fn();
+        auto stop = std::chrono::high_resolution_clock::now();
+
+        std::chrono::duration<double> elapsed = stop - start;
+        best = std::max(best, bytes / elapsed.count() / 1e9);
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv) {
+    size_t size = (argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024) << 20;
+    std::string path = argc > 2 ? argv[2] : (std::filesystem::temp_directory_path() / "vigor_bench.txt").string();
+
+    std::printf("Writing %zu MiB of text to %s\n", size >> 20, path.c_str());
+
+    if (!write_synthetic_file(path, size)) {
+        std::fprintf(stderr, "Failed to write %s\n", path.c_str());
+        return 1;
+    }
+
+    // Read back in rather than kept from generating it, the same as a file
+    // the editor loads
+    std::string data;
+    {
+        std::ifstream file(path, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    std::filesystem::remove(path);
+
+    // Without any newline to stop at, the backwards scan has to go through
+    // the whole thing
+    std::string no_newlines(data, 0, std::min<size_t>(data.size(), 256 << 20));
+    std::replace(no_newlines.begin(), no_newlines.end(), '\n', ' ');
+
+    ScanPath best = get_scan_path();
+    std::vector<uint64_t> positions;
+    size_t expected = 0;
+
+    std::printf("%-8s %16s %16s %16s %16s\n", "path", "count_newlines", "find_line_starts", "find_last", "build_line_index");
+
+    for (ScanPath path : {ScalarScan, SSE2Scan, AVX2Scan}) {
+        if (path > best) {
+            std::printf("%-8s (not supported)\n", scan_path_name(path));
+            continue;
+        }
+
+        set_scan_path(path);
+
+        size_t count = 0;
+        double count_rate = measure(data.size(), [&]() {
+            count = count_newlines(data.data(), data.size());
+        });
+
+        // Reserving up front keeps the allocation out of the timings
+        positions.reserve(count);
+
+        double starts_rate = measure(data.size(), [&]() {
+            positions.clear();
+            find_line_starts(data.data(), data.size(), 0, positions);
+        });
+
+        const char *last = nullptr;
+        double last_rate = measure(no_newlines.size(), [&]() {
+            last = find_last_newline(no_newlines.data(), no_newlines.size());
+        });
+
+        double index_rate = measure(data.size(), [&]() {
+            positions.clear();
+            build_line_index(data.data(), data.size(), 0, positions);
+        });
+
+        // Every path had better agree on the answer
+        if (path == ScalarScan) {
+            expected = count;
+        }
+
+        if (count != expected || positions.size() != expected || last) {
+            std::fprintf(stderr, "The %s scanners disagree with the scalar ones\n", scan_path_name(path));
+            return 1;
+        }
+
+        std::printf(
+            "%-8s %11.2f GB/s %11.2f GB/s %11.2f GB/s %11.2f GB/s\n",
+            scan_path_name(path), count_rate, starts_rate, last_rate, index_rate);
+    }
+
+    std::printf("%zu lines\n", expected);
+
+    return 0;
+}
@@ -0,0 +1,267 @@
+#include "vigor/utf8.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+// Compares the two ways the text layer has laid out a screen of text: four
+// vertices per cell with a UV and a color for each (everything up to the
+// switch to instanced cells), and the single CellInstance per cell it uses
+// now. TextLayer can't be made without a GL context, so both loops are
+// copied from text_layer.cpp, minus the uploads, and run against a glyph
+// table with the same ranges and lookups as the real one.
+//
+// Usage: text_layout_bench [columns] [rows]
+
+// Every measurement is the best of this many runs, each of which lays out
+// this many screens
+static const int runs = 5;
+static const int screens = 500;
+
+// Pixel size of a cell, which only matters to the old layout
+static const int cell_width = 14;
+static const int cell_height = 24;
+
+struct Glyph {
+    int size[2];
+    int bearing[2];
+    unsigned int advance;
+    float uv_start[2];
+    float uv_stop[2];
+    uint16_t id;
+};
+
+// The same as in text_layer.h, without the GL types
+struct CellInstance {
+    uint16_t column;
+    uint16_t row;
+    uint16_t glyph;
+    uint16_t style;
+};
+
+static std::map<char32_t, Glyph> glyphs;
+static uint16_t ascii_glyph_ids[0x80];
+
+static const std::pair<char32_t, char32_t> glyph_ranges[] = {
+    {0x0000, 0x007F},
+    {0x00A0, 0x017F},
+    {0x0370, 0x03FF},
+    {0x0400, 0x04FF},
+    {0x2010, 0x2027},
+    {0x2190, 0x21FF},
+    {0x2500, 0x259F},
+    {0xFFFD, 0xFFFD},
+};
+
+static Glyph find_glyph(char32_t c) {
+    auto it = glyphs.find(c);
+
+    if (it == glyphs.end()) {
+        it = glyphs.find(replacement_character);
+    }
+
+    return it->second;
+}
+
+static uint16_t find_glyph_id(char32_t c) {
+    return c < 0x80 ? ascii_glyph_ids[c] : find_glyph(c).id;
+}
+
+static void make_glyphs() {
+    uint16_t id = 0;
+
+    for (const auto &[first, last] : glyph_ranges) {
+        for (char32_t c = first; c <= last; ++c) {
+            glyphs[c] = {{10, 18}, {2, 17}, cell_width * 64, {0.0f, 0.0f}, {0.02f, 0.04f}, id++};
+        }
+    }
+
+    for (char32_t c = 0; c < 0x80; ++c) {
+        ascii_glyph_ids[c] = find_glyph(c).id;
+    }
+}
+
+// Code-like lines of up to a hundred and fifty columns, some indented with a
+// tab and the odd one with a few non-ASCII characters in it
+static std::vector<std::string> make_lines(size_t count) {
+    static const char32_t extras[] = {0x00E9, 0x03BB, 0x0436, 0x2014, 0x2192, 0x2500, 0x2502};
+
+    std::mt19937 rng(1);
+    std::vector<std::string> lines(count);
+
+    for (std::string &line : lines) {
+        if (rng() % 4 == 0) {
+            line += '\t';
+        }
+
+        size_t length = rng() % 150;
+
+        for (size_t i = 0; i < length; ++i) {
+            if (rng() % 200 == 0) {
+                encode_utf8(extras[rng() % std::size(extras)], line);
+            } else {
+                line += char(' ' + rng() % 95);
+            }
+        }
+    }
+
+    return lines;
+}
+
+// Runs `fn` a few times and returns the best time per screen in microseconds
+template <typename Fn>
+static double measure(Fn fn) {
+    double best = 0.0;
+
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (int screen = 0; screen < screens; ++screen) {
+            fn(screen);
+        }
+
+        auto stop = std::chrono::high_resolution_clock::now();
+
+        std::chrono::duration<double, std::micro> elapsed = stop - start;
+        double per_screen = elapsed.count() / screens;
+        best = i == 0 ? per_screen : std::min(best, per_screen);
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv) {
+    unsigned int columns = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 275;
+    unsigned int rows = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 60;
+    size_t cells = size_t(columns) * rows;
+
+    make_glyphs();
+    std::vector<std::string> lines = make_lines(4096);
+    std::u32string codepoints;
+
+    std::printf("Laying out %ux%u cells\n", columns, rows);
+
+    // Two floats of position and two of UV plus four of color for each of
+    // the four vertices, and six indices
+    std::vector<float> vertices(8 * cells);
+    std::vector<float> uvs(8 * cells);
+    std::vector<float> colors(16 * cells);
+    size_t old_bytes = cells * (32 * sizeof(float) + 6 * sizeof(uint16_t));
+
+    float to_screen_width = 2.0f / (columns * cell_width);
+    float to_screen_height = 2.0f / (rows * cell_height);
+    float space_advance = glyphs[' '].advance / 64.0f * to_screen_width;
+    float font_height = cell_height * to_screen_height;
+
+    double old_time = measure([&](int screen) {
+        float last_y = 1.0f;
+
+        for (unsigned int row = 0; row < rows; ++row) {
+            const std::string &line = lines[(screen + row) % lines.size()];
+            float last_x = -1.0f;
+
+            decode_utf8(line.data(), line.size(), codepoints);
+
+            for (unsigned int column = 0; column < columns;) {
+                char32_t c = column < codepoints.size() ? codepoints[column] : ' ';
+                Glyph glyph = find_glyph(c);
+                unsigned int idx = (row * columns + column) * 4;
+
+                if (c == '\t') {
+                    last_x += 4.0f * space_advance;
+                    column += 4;
+                    continue;
+                }
+
+                float advance = glyph.advance / 64.0f * to_screen_width;
+                float bearing_x = float(glyph.bearing[0]) * to_screen_width;
+                float bearing_y = float(glyph.bearing[1]) * to_screen_height;
+                float width = float(glyph.size[0]) * to_screen_width;
+                float height = float(glyph.size[1]) * to_screen_height;
+
+                float x_pos = last_x + bearing_x;
+                float y_pos = last_y + bearing_y - font_height;
+
+                float corners[8] = {
+                    x_pos, y_pos - height,
+                    x_pos, y_pos,
+                    x_pos + width, y_pos,
+                    x_pos + width, y_pos - height,
+                };
+                float corner_uvs[8] = {
+                    glyph.uv_start[0], glyph.uv_stop[1],
+                    glyph.uv_start[0], glyph.uv_start[1],
+                    glyph.uv_stop[0], glyph.uv_start[1],
+                    glyph.uv_stop[0], glyph.uv_stop[1],
+                };
+
+                std::copy(corners, corners + 8, vertices.begin() + 2 * idx);
+                std::copy(corner_uvs, corner_uvs + 8, uvs.begin() + 2 * idx);
+                std::fill(colors.begin() + 4 * idx, colors.begin() + 4 * idx + 16, 1.0f);
+
+                last_x += advance;
+                column++;
+            }
+
+            last_y -= font_height;
+        }
+    });
+
+    std::vector<CellInstance> instances(cells);
+    size_t new_bytes = cells * sizeof(CellInstance);
+
+    double new_time = measure([&](int screen) {
+        for (unsigned int row = 0; row < rows; ++row) {
+            const std::string &line = lines[(screen + row) % lines.size()];
+            bool ascii = is_ascii(line.data(), line.size());
+            size_t length = line.size();
+
+            if (!ascii) {
+                decode_utf8(line.data(), line.size(), codepoints);
+                length = codepoints.size();
+            }
+
+            CellInstance *row_cells = instances.data() + row * columns;
+            uint16_t ring_row = uint16_t(screen + row);
+            uint16_t blank = find_glyph_id(' ');
+            unsigned int column = 0;
+
+            for (size_t i = 0; i < length && column < columns; ++i) {
+                char32_t c = ascii ? static_cast<unsigned char>(line[i]) : codepoints[i];
+
+                if (c == '\t') {
+                    unsigned int tab_stop = std::min(column + 4, columns);
+
+                    for (; column < tab_stop; ++column) {
+                        row_cells[column] = {uint16_t(column), ring_row, blank, 0};
+                    }
+
+                    continue;
+                }
+
+                row_cells[column] = {uint16_t(column), ring_row, find_glyph_id(c), 0};
+                column++;
+            }
+
+            for (; column < columns; ++column) {
+                row_cells[column] = {uint16_t(column), ring_row, blank, 0};
+            }
+        }
+    });
+
+    std::printf("%-10s %12s %16s\n", "layout", "per screen", "per upload");
+    std::printf("%-10s %9.1f us %13zu KB\n", "vertices", old_time, old_bytes >> 10);
+    std::printf("%-10s %9.1f us %13zu KB\n", "instances", new_time, new_bytes >> 10);
+
+    // Keeps the layouts from being optimized away
+    std::printf("(%g %u)\n", vertices[5] + uvs[5] + colors[5], unsigned(instances[cells / 2].glyph));
+
+    return 0;
+}
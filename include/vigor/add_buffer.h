@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Append-only storage for inserted text. Text is kept in blocks that are never
+// reallocated, so a pointer into the add buffer stays valid for as long as the
+// buffer itself, no matter how much gets appended afterwards. That's what lets
+// other threads (saving, for one) read pieces while editing carries on.
+//
+// Offsets are continuous within a block. Each new block starts one past the
+// end of the previous block's capacity, so text in two different blocks can
+// never look like it's adjacent.
+//
+// Copies share both the text and the list of blocks, so a copy is a cheap
+// way for another thread to keep reading what's been appended so far. The
+// list only ever gets copied when a new block is needed while it's shared.
+class AddBuffer {
+    private:
+        static constexpr size_t block_size = 64 << 10;
+
+        // Blocks never change once they're in the list, only how much of
+        // the last one is used does, and that's kept out here
+        struct Block {
+            size_t start;
+            size_t capacity;
+            std::shared_ptr<char[]> data;
+        };
+
+        std::shared_ptr<std::vector<Block>> blocks = std::make_shared<std::vector<Block>>();
+        size_t used = 0;
+    public:
+        AddBuffer() {}
+
+        void clear();
+        size_t append(std::string_view text);
+        const char *data(size_t offset) const;
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "buffer_snapshot.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <re2/re2.h>
+
+enum SearchMode {
+    Literal,
+    Regex,
+};
+
+// Where a match is in the document. Columns and lengths are in bytes.
+struct SearchMatch {
+    size_t offset;
+    size_t line;
+    size_t column;
+    size_t length;
+};
+
+// Searches a snapshot of a buffer on a background thread, so editing can
+// carry on in the meantime. The search starts from wherever the viewport is,
+// runs to the end of the document and then wraps around to the start, which
+// means the match nearest the viewport is the first one found. Matches can be
+// looked up while the search is running, and are always sorted by offset.
+//
+// Literal searches are a single vectorized pass, which is already about as
+// fast as memory goes. Regexes are a lot slower, so the document is split
+// into chunks of whole lines that a pool of threads works through, with the
+// lines on screen making up the first chunk. Regexes match within a line, and
+// use RE2, which takes linear time and no stack however long the line is.
+class BufferSearch {
+    private:
+        // Called from the search thread as soon as the first match turns up
+        using match_callable_t = std::function<void(const SearchMatch&)>;
+        match_callable_t match_callback = nullptr;
+
+        // Called from the search thread with the fraction searched so far,
+        // and once more with `done` set when it has finished
+        using progress_callable_t = std::function<void(float progress, bool done)>;
+        progress_callable_t progress_callback = nullptr;
+
+        // Everything one search needs, so a new search can start while the
+        // last one is still winding down. Stopped jobs finish on their own
+        // time, and their threads are joined once they're done.
+        struct SearchJob {
+            std::string needle;
+            SearchMode mode;
+            std::unique_ptr<RE2> regex;
+            std::thread thread;
+            std::atomic<bool> stop = false;
+            std::atomic<bool> done = false;
+        };
+
+        std::string needle;
+        SearchMode mode = Literal;
+        std::unique_ptr<SearchJob> job;
+        std::vector<std::unique_ptr<SearchJob>> stopped_jobs;
+
+        // The regex workers stick around from one search to the next, since
+        // searches get restarted on every keystroke. A search queues up its
+        // share of the work here and waits for all of it before it returns.
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> work;
+        std::mutex work_mutex;
+        std::condition_variable work_ready;
+        bool stop_workers = false;
+
+        // Matches before where the search started are only found once it
+        // wraps around, so they're kept apart from the ones after it. Put
+        // together (in that order) they're sorted.
+        mutable std::mutex match_mutex;
+        std::vector<SearchMatch> wrapped_matches;
+        std::vector<SearchMatch> matches;
+        bool found_first = false;
+
+        // A piece of the document one of the regex workers searches. Lines
+        // are counted from the start of the chunk, since there's no telling
+        // how many lines come before it until the chunks before it are done.
+        struct RegexChunk {
+            size_t start;
+            size_t stop;
+            bool wrapped;
+            bool done = false;
+            size_t newlines = 0;
+            std::vector<SearchMatch> matches;
+
+            RegexChunk(size_t start, size_t stop, bool wrapped) : start(start), stop(stop), wrapped(wrapped) {}
+        };
+
+        void search(SearchJob &job, BufferSnapshot snapshot, size_t from_offset, size_t from_line, size_t visible_lines);
+        bool search_regex(SearchJob &job, const BufferSnapshot &snapshot, size_t from_offset, size_t from_line, size_t visible_lines);
+        void search_regex_chunk(SearchJob &job, const BufferSnapshot &snapshot, RegexChunk &chunk, std::string &scratch);
+        bool search_range(
+            SearchJob &job,
+            const BufferSnapshot &snapshot,
+            size_t start,
+            size_t stop,
+            size_t line,
+            std::vector<SearchMatch> &out,
+            size_t &searched,
+            size_t total);
+        void add_matches(SearchJob &job, std::vector<SearchMatch> &out, std::vector<SearchMatch> &found);
+        void reap_stopped_jobs();
+        void queue_work(std::function<void()> task);
+        void run_worker();
+    public:
+        BufferSearch() {}
+        ~BufferSearch();
+
+        void register_match_callback(match_callable_t cb);
+        void register_progress_callback(progress_callable_t cb);
+
+        // Starts searching `snapshot` for `needle`, beginning at the start
+        // of line `from_line` (which is at `from_offset`) and searching the
+        // `visible_lines` lines from there before anything else. Any search
+        // that's already running is told to stop, but isn't waited for.
+        // Returns false if `needle` isn't a valid regex.
+        bool start(
+            BufferSnapshot snapshot,
+            std::string needle,
+            SearchMode mode = Literal,
+            size_t from_offset = 0,
+            size_t from_line = 0,
+            size_t visible_lines = 0);
+        // Unlike `start`, this waits for every search to have stopped, so
+        // nothing is reading their snapshots anymore once it returns
+        void stop();
+        bool is_searching();
+
+        std::string_view get_needle();
+        size_t match_count();
+        std::optional<SearchMatch> get_match(size_t index);
+
+        // Replaces the contents of `out` with every match found so far on
+        // lines `first_line` through `first_line + count - 1`
+        void matches_in_lines(size_t first_line, size_t count, std::vector<SearchMatch> &out);
+
+        // The first match at or after where the search started, or failing
+        // that the first one before it
+        std::optional<SearchMatch> nearest_match();
+
+        // The first match on a line after (or before) `line`, wrapping
+        // around the document if there isn't one
+        std::optional<SearchMatch> next_match(size_t line);
+        std::optional<SearchMatch> prev_match(size_t line);
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "add_buffer.h"
+#include "mapped_file.h"
+#include "piece_tree.h"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The document as it was at one version of a TextBuffer. Taking a snapshot
+// copies nothing but a handful of pointers, since the piece tree, the add
+// buffer and the original file are all shared with the buffer rather than
+// copied. Edits after that copy only the tree nodes they touch, so the
+// snapshot never changes, and another thread can read it without any
+// locking while editing carries on. It also keeps the file it came from
+// mapped for as long as it's around, even if another file gets loaded.
+class BufferSnapshot {
+    private:
+        friend class TextBuffer;
+
+        PieceTree pieces;
+        AddBuffer added;
+        std::shared_ptr<const MappedFile> original_file;
+        std::shared_ptr<const std::string> original_copy;
+        const char *original = nullptr;
+        size_t version = 0;
+
+        const char *piece_data(const Piece &piece) const;
+    public:
+        BufferSnapshot() {}
+
+        size_t get_version() const;
+        size_t size() const;
+
+        // Line counts only cover as much of the original file as had been
+        // indexed when the snapshot was taken
+        size_t line_count() const;
+
+        void read_range(size_t start, size_t stop, std::string &out) const;
+
+        // Points straight into the shared storage when the range sits inside
+        // one piece, and copies it into `scratch` otherwise
+        std::string_view view_range(size_t start, size_t stop, std::string &scratch) const;
+
+        // The first line start at or after `offset`, or the end of the
+        // document if there isn't one
+        size_t next_line_start(size_t offset) const;
+
+        // The whole document, in order, as views into the shared storage.
+        // They stay valid for as long as the snapshot does.
+        std::vector<std::string_view> spans() const;
+};
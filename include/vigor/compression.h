@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <string>
+
+enum Compression {
+    Uncompressed,
+    Gzip,
+    Zstd,
+};
+
+// Works out how a file is compressed from its magic number
+Compression detect_compression(const std::string &filepath);
+const char *compression_name(Compression compression);
+
+// Decompresses `in` a chunk at a time, handing each decompressed chunk to
+// `sink`, so memory use stays flat no matter how big the file is. Stops early
+// (and successfully) once `sink` returns false. Returns false if the input is
+// corrupt or cut short.
+using decompress_sink_t = std::function<bool(const char *data, size_t len)>;
+bool decompress_stream(std::FILE *in, Compression compression, decompress_sink_t sink);
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "buffer_search.h"
 #include "event.h"
 
+#include <mutex>
 #include <optional>
 #include <string>
 #include <queue>
@@ -13,10 +15,23 @@ class Engine {
         std::queue<Event> incoming_event_queue;
         std::queue<Event> outgoing_event_queue;
 
+        // Background work (like indexing) adds incoming events from other threads
+        std::mutex incoming_event_mutex;
+
         std::optional<Event> pop_incoming_event();
 
+        // Ctrl+F starts typing a search query (Ctrl+Shift+F a regex), which
+        // gets searched for again every time it changes until Enter is hit
+        bool entering_query = false;
+        std::string query;
+        SearchMode query_mode = Literal;
+
         // Internal handlers
         void handle_key_event(int key, int scancode, int action, int mods);
+        void handle_char_event(unsigned int codepoint);
+        void handle_follow();
+        void start_search();
+        void show_match(std::optional<SearchMatch> match);
     public:
         Engine();
         ~Engine();
@@ -24,6 +39,7 @@ class Engine {
         void pre_window_startup();
         void post_window_startup();
         void process_events();
+        void teardown();
 
         void add_incoming_event(Event event);
         void add_outgoing_event(Event event);
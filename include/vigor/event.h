@@ -12,7 +12,16 @@
 enum EventType {
     WindowResize,
     Key,
+    Char,
     CursorPosition,
+    BufferIndexProgress,
+    BufferSaveProgress,
+    BufferSaveComplete,
+    BufferDecompressProgress,
+    BufferDecompressComplete,
+    BufferSearchProgress,
+    BufferSearchMatch,
+    BufferSearchComplete,
     WindowResizeRequest,
     LayerUpdateRequest,
     BufferModifyRequest,
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Tells us when a file on disk may have changed. On Linux this is driven by
+// inotify, everywhere else it falls back to checking the file's size every
+// time it's polled. Either way nothing blocks, so it's fine to poll every frame.
+class FileWatcher {
+    private:
+        std::string filepath;
+        bool watching = false;
+
+#ifdef __linux__
+        int inotify_fd = -1;
+        int watch_fd = -1;
+
+        void add_watch();
+#else
+        uint64_t last_size = 0;
+#endif
+    public:
+        // Which file a path leads to right now, as the device it's on and
+        // its inode (or file index on Windows). A rotated file keeps its
+        // name but not this.
+        struct Identity {
+            uint64_t device;
+            uint64_t index;
+
+            bool operator==(const Identity &other) const = default;
+        };
+
+        FileWatcher() {}
+        ~FileWatcher();
+
+        FileWatcher(const FileWatcher&) = delete;
+        FileWatcher &operator=(const FileWatcher&) = delete;
+
+        bool watch(const std::string &filepath);
+        void stop();
+        bool is_watching();
+
+        // Returns true if the file may have changed since the last poll
+        bool poll();
+
+        // All zero if there's nothing there
+        static Identity identify(const std::string &filepath);
+};
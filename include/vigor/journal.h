@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Crash recovery journal for a buffer. Instead of mirroring the whole document,
+// each edit is appended as a small checksummed record, so journaling a keystroke
+// costs about as much as the keystroke itself. Records only make sense on top
+// of the file they were made against, which the header identifies by size and
+// modification time, so a journal for some other version of the file is thrown
+// away instead of replayed.
+//
+// Records pile up as editing goes on. Every so often the journal is rewritten
+// in the background as the smallest set of edits that turns the base file into
+// the current document, and the same thing happens after a save, with the saved
+// file as the new base.
+class Journal {
+    public:
+        enum RecordType : uint8_t {
+            Insert = 1,
+            Erase = 2,
+        };
+
+        struct Record {
+            RecordType type;
+            uint64_t offset;
+            uint64_t count;
+            std::string_view text;
+        };
+
+        struct Base {
+            uint64_t size;
+            int64_t mtime;
+        };
+
+        // A rebase that's been started, and where in everything journaled
+        // since opening it started from
+        struct Rebase {
+            uint64_t id;
+            uint64_t mark;
+        };
+
+        using replay_callable_t = std::function<void(const Record&)>;
+    private:
+        static constexpr size_t compact_threshold = 1 << 20;
+
+        std::string path;
+        std::FILE *file = nullptr;
+        Base base = {0, 0};
+        size_t journal_size = 0;
+        size_t compacted_size = 0;
+
+        // Records made while the journal is being rewritten are kept here
+        // as well, so they can be carried over into the new one. A save can
+        // start rebasing while a compaction still is, so `pending` goes back
+        // to the oldest running rebase (`pending_mark`) and each one takes
+        // what came after its own start.
+        unsigned int rebasing = 0;
+        std::string pending;
+        uint64_t written = 0;
+        uint64_t pending_mark = 0;
+        uint64_t last_rebase = 0;
+        uint64_t newest_rebase = 0;
+
+        std::mutex mutex;
+        std::mutex rebase_mutex;
+        std::thread compact_thread;
+
+        void write_record(const Record &record);
+        void end_rebase();
+    public:
+        Journal() {}
+        ~Journal();
+
+        Journal(const Journal&) = delete;
+        Journal &operator=(const Journal&) = delete;
+
+        static Base file_base(const std::string &filepath);
+
+        // Replays whatever records are still good in an existing journal for
+        // `base`, then keeps appending to it. Returns the number replayed.
+        size_t open(std::string path, Base base, replay_callable_t replay);
+        void close(bool discard);
+        bool is_open();
+
+        void record_insert(size_t offset, std::string_view text);
+        void record_erase(size_t offset, size_t count);
+
+        // A rebase starts at the point the document was snapshotted, and
+        // finishes once `records` (relative to the new base) are known.
+        // The text in `records` has to stay valid until then. Rebases
+        // finish one at a time, and one that started before the last to
+        // finish is dropped, since that one already covers everything.
+        Rebase start_rebase();
+        bool finish_rebase(Rebase rebase, Base base, const std::vector<Record> &records);
+        void cancel_rebase(Rebase rebase);
+
+        bool is_rebasing();
+
+        // Rebases in the background, onto `base` or the current base
+        void rebase(Base base, std::vector<Record> records);
+        bool should_compact();
+        void compact(std::vector<Record> records);
+        void wait_for_compaction();
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A compact, append-only list of sorted 64-bit offsets (i.e. line starts).
+//
+// Offsets are stored in blocks of `block_size`. Each block keeps its first
+// offset in full and every other offset as a delta from that, bit-packed at
+// the smallest width that fits the block's largest delta. Any entry can still
+// be read in constant time, but ordinary text costs 1-2 bytes per line rather
+// than 8.
+//
+// In sparse mode only a checkpoint every so many lines (or bytes) is kept, and
+// everything in between is found again by scanning the indexed data from the
+// nearest checkpoint. Room for as many checkpoints as the memory cap allows
+// is set aside up front, and whenever that fills up every other one is
+// dropped, so memory use stays flat no matter the file size.
+class LineIndex {
+    public:
+        enum Mode {
+            Dense,
+            Sparse,
+        };
+    private:
+        static const size_t block_size = 128;
+
+        Mode mode = Dense;
+
+        struct Block {
+            uint64_t base;
+            uint64_t word_offset;
+            uint32_t width;
+        };
+
+        std::vector<Block> blocks;
+        std::vector<uint64_t> words;
+
+        // Entries that don't fill a whole block yet are kept as is
+        std::vector<uint64_t> tail;
+
+        struct Checkpoint {
+            uint64_t line;
+            uint64_t offset;
+        };
+
+        // Sparse mode only
+        const char *data = nullptr;
+        size_t data_size = 0;
+        size_t max_checkpoints = 0;
+        size_t checkpoint_lines = 0;
+        size_t checkpoint_bytes = 0;
+        size_t entry_count = 0;
+        std::vector<Checkpoint> checkpoints;
+
+        void seal_tail();
+        uint64_t block_entry(const Block &block, size_t idx) const;
+        void add_checkpoint(uint64_t line, uint64_t offset);
+        void thin_checkpoints();
+        const Checkpoint *checkpoint_for_line(uint64_t line) const;
+        const Checkpoint *checkpoint_for_offset(uint64_t offset) const;
+    public:
+        LineIndex() {}
+
+        void use_dense();
+        void use_sparse(const char *data, size_t data_size, size_t memory_cap);
+
+        // Sparse mode only. Points the index at a new copy of the same data,
+        // which may have more of it on the end.
+        void set_data(const char *data, size_t data_size);
+        Mode get_mode() const;
+
+        void clear();
+        void push_back(uint64_t offset);
+        void append(const uint64_t *offsets, size_t count);
+
+        // Sparse mode only. Adds the line start after every newline in
+        // [start, stop) of the data, scanning for them directly rather than
+        // having them all found up front, since only the odd one is kept.
+        void scan(uint64_t start, uint64_t stop);
+        void shrink_to_fit();
+
+        size_t size() const;
+        uint64_t at(size_t idx) const;
+        size_t upper_bound(uint64_t offset) const;
+        size_t memory_usage() const;
+};
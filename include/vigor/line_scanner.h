@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Vectorized newline scanning. These pick the widest instruction set the CPU
+// supports at runtime (AVX2, then SSE2) and fall back to plain scalar code
+// everywhere else. Only '\n' is looked for, which covers CRLF files as well
+// since every "\r\n" ends in one.
+
+// The implementations the scanners can use, from slowest to fastest
+enum ScanPath {
+    ScalarScan,
+    SSE2Scan,
+    AVX2Scan,
+};
+
+// Picks which implementation the scanners use, which is mainly useful for
+// benchmarking them against each other. It starts out as the fastest the CPU
+// supports, and can't be set past that. Set it before any scanning starts,
+// since nothing stops it changing under a scan on another thread.
+void set_scan_path(ScanPath path);
+ScanPath get_scan_path();
+
+// Returns the number of '\n' bytes in `data`
+size_t count_newlines(const char *data, size_t length);
+
+// Returns a pointer to the last '\n' in `data`, or nullptr if there isn't one.
+// This is the backwards counterpart to `memchr`.
+const char *find_last_newline(const char *data, size_t length);
+
+// Returns a pointer to the `n`th '\n' in `data` (counting from 1), or nullptr
+// if there aren't that many
+const char *find_nth_newline(const char *data, size_t length, size_t n);
+
+// Appends the offset of every line start in `data` (that is, the offset just
+// past each '\n') to `positions`, with `base` added to each offset
+void find_line_starts(const char *data, size_t length, size_t base, std::vector<uint64_t> &positions);
+
+// Same as `find_line_starts`, except the data is split into chunks that are
+// scanned in parallel. With `threads` set to 0 one thread is used per core.
+void build_line_index(const char *data, size_t length, size_t base, std::vector<uint64_t> &positions, unsigned int threads = 0);
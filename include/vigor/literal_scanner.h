@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+// Vectorized substring search. Like the newline scanners, this picks AVX2 or
+// SSE2 at runtime (following `set_scan_path`) and falls back to `memchr`
+// everywhere else. Candidates are
+// found by comparing a block of bytes against the needle's first byte and the
+// block `needle.size() - 1` further on against its last byte, so only the
+// (rare) positions where both match get compared in full.
+
+// Returns a pointer to the first occurrence of `needle` in `data`, or nullptr
+// if there isn't one (or `needle` is empty)
+const char *find_literal(const char *data, size_t length, std::string_view needle);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// A read-only memory mapping of an entire file. Pages are only faulted in
+// once something actually touches them, so opening a file is cheap no matter
+// how large it is.
+class MappedFile {
+    private:
+        const char *mapping = nullptr;
+        size_t mapping_size = 0;
+
+#ifdef _WIN32
+        void *file_handle = nullptr;
+        void *mapping_handle = nullptr;
+
+        // Where the mapped file is now, which saving over it can change
+        std::string path;
+        bool delete_on_close = false;
+#else
+        int fd = -1;
+#endif
+    public:
+        enum Advice {
+            Normal,
+            Sequential,
+            Random,
+            WillNeed,
+            DontNeed,
+        };
+
+        MappedFile() {}
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool open(const std::string &filepath);
+        void close();
+
+        void advise(size_t offset, size_t length, Advice advice) const;
+
+        // Moves `replacement` over `filepath`. Windows won't do that to a
+        // mapped file, so if it's this one, it gets renamed out of the way
+        // instead and deleted once the mapping is closed.
+        bool replace(const std::string &filepath, const std::string &replacement);
+
+        const char *data() const;
+        size_t size() const;
+        bool is_open() const;
+};
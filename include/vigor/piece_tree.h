@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+enum PieceSource {
+    Original,
+    Add,
+};
+
+struct Piece {
+    PieceSource source;
+    size_t start;
+    size_t length;
+    size_t newlines;
+};
+
+// A B-tree (rope) of pieces. Every node keeps the total length, newline count
+// and piece count of its subtree, so finding the piece at a byte offset, the
+// piece holding the nth newline, or the nth piece are all O(log n), as are
+// inserts and erases anywhere in the document.
+//
+// Nodes are shared between copies of a tree, and a node is only copied when
+// it's about to change while another tree still points at it. Copying a tree
+// is therefore O(1), and an edit only ever copies the nodes on its path from
+// the root, leaving every other copy exactly as it was. Nothing is copied
+// at all while there's only the one tree.
+class PieceTree {
+    private:
+        static const size_t max_entries = 32;
+        static const size_t min_entries = max_entries / 2;
+
+        struct Node {
+            bool leaf = true;
+            size_t length = 0;
+            size_t newlines = 0;
+            size_t count = 0;
+
+            // How far into the original the furthest reaching piece of it
+            // in this subtree goes
+            size_t original_stop = 0;
+
+            // Leaves hold pieces, everything else holds children
+            std::vector<Piece> pieces;
+            std::vector<std::shared_ptr<Node>> children;
+
+            size_t entries() const;
+            void update();
+        };
+
+        std::shared_ptr<Node> root;
+
+        static Node *own(std::shared_ptr<Node> &node);
+        std::shared_ptr<Node> insert(std::shared_ptr<Node> &node, size_t index, const Piece &piece);
+        void erase(std::shared_ptr<Node> &node, size_t index);
+        void set(std::shared_ptr<Node> &node, size_t index, const Piece &piece);
+        void rebalance(Node *node, size_t child_idx);
+        void transform_original(std::shared_ptr<Node> &node, size_t past, const std::function<void(Piece&)> &fn);
+    public:
+        // Where a piece sits in the document
+        struct Location {
+            size_t index;           // Which piece
+            size_t offset;          // Offset into the piece
+            size_t start;           // Document offset of the piece
+            size_t newlines_before; // Newlines before the piece
+        };
+
+        PieceTree();
+
+        void clear();
+
+        size_t length() const;
+        size_t newlines() const;
+        size_t count() const;
+
+        const Piece &at(size_t index) const;
+        Location find_offset(size_t offset) const;
+        std::optional<Location> find_newline(size_t n) const;
+
+        void insert(size_t index, const Piece &piece);
+        void erase(size_t index);
+        void set(size_t index, const Piece &piece);
+        // Calls `fn` on every piece of the original reaching past `past`.
+        // Subtrees without any are skipped, so they're never copied either.
+        void transform_original(size_t past, const std::function<void(Piece&)> &fn);
+};
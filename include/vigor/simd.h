@@ -0,0 +1,63 @@
+#pragma once
+
+// Shared plumbing for the vectorized scanners. Everything x86 specific is
+// behind VIGOR_X86, and AVX2 code is compiled per function (VIGOR_TARGET_AVX2)
+// so it only runs once `has_avx2` says the CPU supports it.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define VIGOR_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef VIGOR_X86
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VIGOR_TARGET_AVX2 __attribute__((target("avx2")))
+#define VIGOR_CTZ(x) __builtin_ctz(x)
+#define VIGOR_CLZ(x) __builtin_clz(x)
+#else
+#define VIGOR_TARGET_AVX2
+inline unsigned int vigor_ctz(unsigned int x) {
+    unsigned long idx;
+    _BitScanForward(&idx, x);
+    return idx;
+}
+inline unsigned int vigor_clz(unsigned int x) {
+    unsigned long idx;
+    _BitScanReverse(&idx, x);
+    return 31 - idx;
+}
+#define VIGOR_CTZ(x) vigor_ctz(x)
+#define VIGOR_CLZ(x) vigor_clz(x)
+#endif
+
+inline bool cpu_has_avx2() {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+
+    if (info[0] < 7) {
+        return false;
+    }
+
+    // The OS also has to save the YMM registers for us
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+
+    __cpuidex(info, 7, 0);
+    return os_saves_ymm && (info[1] & (1 << 5));
+#else
+    return false;
+#endif
+}
+
+// Only checked once, at startup
+inline const bool has_avx2 = cpu_has_avx2();
+
+#endif
@@ -1,31 +1,285 @@
 #pragma once
 
+#include "add_buffer.h"
+#include "buffer_snapshot.h"
+#include "compression.h"
+#include "file_watcher.h"
+#include "journal.h"
+#include "line_index.h"
+#include "mapped_file.h"
+#include "piece_tree.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
 #include <functional>
-#include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <optional>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
+// One transaction's worth of changes to a buffer. The bytes in
+// [offset, offset + removed) of the old document were replaced by the bytes in
+// [offset, offset + inserted) of the new one. Likewise, lines `first_line`
+// through `first_line + removed_lines` were replaced by lines `first_line`
+// through `first_line + inserted_lines`, so everything after them moved by
+// the difference.
+struct BufferChange {
+    size_t version;
+    size_t offset;
+    size_t removed;
+    size_t inserted;
+    size_t first_line;
+    size_t removed_lines;
+    size_t inserted_lines;
+};
+
+// How lines end in the file on disk. Lines handed out by the buffer never
+// include their terminator either way.
+enum LineEnding {
+    LF,
+    CRLF,
+};
+
+// TextBuffer stores the document as a piece table. The original file contents
+// are kept read-only (and are usually memory mapped), and every inserted byte
+// is appended to a separate add buffer. The document itself is just an ordered
+// list of pieces that each point at a span of one of those two buffers, kept
+// in a balanced tree so lookups by offset or line number stay logarithmic.
 class TextBuffer {
 private:
-    using callable_t = std::function<bool(std::filebuf::int_type)>;
-    callable_t callback = nullptr;
-    std::fstream stream;
+    // Called once per transaction, after the change has been made
+    using change_callable_t = std::function<void(const BufferChange&)>;
+    std::vector<change_callable_t> change_callbacks;
+
+    // Called from the indexing thread with the fraction of the original
+    // file indexed so far
+    using index_callable_t = std::function<void(float)>;
+    index_callable_t index_callback = nullptr;
+
+    // Called from the save (or decompression) thread with the fraction done
+    // so far, and once more with `done` set when it has finished or failed
+    using progress_callable_t = std::function<void(float progress, bool done, bool success)>;
+    progress_callable_t save_callback = nullptr;
+    progress_callable_t decompress_callback = nullptr;
+
+    // Called when a followed file shrinks or is replaced, before it's
+    // reloaded (with `done` unset) and again after. Anything still reading
+    // the old file, snapshots included, has to let go of it in between.
+    using reload_callable_t = std::function<void(bool done)>;
+    reload_callable_t reload_callback = nullptr;
+
+    std::string filepath;
+
+    // The original contents are served straight out of a read-only mapping
+    // of the file when possible, `original_copy` only backs them otherwise.
+    // Both are shared with any snapshots still reading them.
+    std::shared_ptr<MappedFile> original_file = std::make_shared<MappedFile>();
+    std::shared_ptr<std::string> original_copy = std::make_shared<std::string>();
+    const char *original = nullptr;
+    size_t original_size = 0;
+
+    AddBuffer added;
+    PieceTree pieces;
+
+    // These replace the get and put pointers of the old swap file stream
+    size_t read_pos = 0;
+    size_t write_pos = 0;
+
+    // Lines that span pieces are stitched together in here, so the line
+    // views we hand out always have something to point at
+    std::string line_scratch;
+    std::vector<std::string> lines_scratch;
+    std::vector<std::string_view> line_views;
 
     unsigned int start_line = 0;
     unsigned int stop_line = 0;
     unsigned int max_buffer_height = 24;
 
-    std::vector<unsigned int> line_positions;
+    // Offset of every line start in the original file, which lets pieces of
+    // the original count their newlines without rescanning. This is filled
+    // in by a background thread, and only covers the first `indexed_size`
+    // bytes of the original until it finishes.
+    //
+    // While a file is still decompressing (`index_growing`), the original is
+    // swapped out for a longer copy under `index_mutex` as it comes in, and
+    // the indexer waits on `index_grown` for more rather than finishing. That
+    // way nothing on the main thread has to stop it in between.
+    LineIndex line_positions;
+    LineIndex::Mode index_mode = LineIndex::Dense;
+    size_t index_memory_cap = 0;
+    size_t indexed_size = 0;
+    mutable std::mutex index_mutex;
+    std::condition_variable index_grown;
+    std::thread index_thread;
+    std::atomic<bool> stop_index_thread = false;
+    bool index_running = false;
+    bool index_growing = false;
+
+    std::thread save_thread;
+    std::atomic<bool> saving = false;
+    Journal::Rebase save_rebase = {0, 0};
+
+    // Compressed files are decompressed out to a hidden file next to them in
+    // the background, which then gets mapped just like any other file.
+    // Whatever has been flushed out so far (`decompressed_size`) is mapped
+    // and indexed as it comes, but there's no editing until the whole file
+    // is there.
+    Compression compression = Uncompressed;
+    std::string decompressed_path;
+    std::thread decompress_thread;
+    std::atomic<bool> stop_decompress_thread = false;
+    std::atomic<bool> decompress_succeeded = false;
+    std::atomic<size_t> decompressed_size = 0;
+    bool decompressing = false;
+    bool read_only = false;
+
+    // Every edit bumps `version`, and `saved_version` is whatever version
+    // last made it to disk
+    size_t version = 0;
+    std::atomic<size_t> saved_version = 0;
+
+    // Edits are journaled against the file as it was when the journal was
+    // last rebased. That file is described here as the spans of our own
+    // storage it's made up of (sorted by address) and their offsets in it.
+    struct BaseSpan {
+        const char *data;
+        size_t length;
+        size_t offset;
+    };
+
+    Journal journal;
+    std::vector<BaseSpan> journal_base;
+
+    // In follow mode, `follow_offset` is how much of the file on disk has
+    // made it into the buffer, and `follow_size` is how big we last saw it.
+    // `follow_identity` is the file we loaded (or last saved), anything else
+    // turning up under its name means it was rotated. Text read from disk
+    // becomes part of the journal's base, so the journal is rebased after
+    // it, which `journal_behind` is set until it has been.
+    FileWatcher follow_watcher;
+    FileWatcher::Identity follow_identity = {0, 0};
+    size_t follow_offset = 0;
+    size_t follow_size = 0;
+    bool appending_from_disk = false;
+    bool journal_behind = false;
+
+    // The indexer checks the original is valid UTF-8 as it goes, up to
+    // `validated_size`. Invalid bytes still display, just as U+FFFD.
+    size_t validated_size = 0;
+    bool valid_utf8 = true;
+
+    // Worked out from the start of the file when it's loaded. Newlines
+    // typed into a CRLF file get their '\r' added on the way in, so the
+    // document always matches what gets written back.
+    LineEnding line_ending = LF;
+
+    // Edits made during a transaction are merged into one change, which
+    // subscribers hear about when the outermost transaction ends
+    unsigned int transaction_depth = 0;
+    bool transaction_changed = false;
+    size_t transaction_newlines = 0;
+    size_t change_offset = 0;
+    size_t change_removed = 0;
+    size_t change_inserted = 0;
+
+    // How much of the index the piece newline counts currently reflect.
+    // This only moves forward in `sync_index`, on the main thread.
+    size_t index_frontier = 0;
+
+    bool decompress_head();
+    void decompress_original(std::string path, std::FILE *out);
+    void remove_decompressed();
+    void swap_in_decompressed(std::shared_ptr<MappedFile> file, size_t size);
+    void start_indexing();
+    void set_index_growing(bool growing);
+    void finish_loading();
+    void index_head();
+    void detect_line_ending(const char *data, size_t length);
+    void validate_original(const char *data, size_t size, size_t stop);
+    void normalize_newlines(std::string &text, size_t offset) const;
+    void index_original();
+    Piece make_piece(PieceSource source, size_t start, size_t length) const;
+    const char *piece_data(const Piece &piece) const;
+    void insert_piece(size_t offset, Piece piece);
+    void remove_range(size_t offset, size_t count);
+    void read_range(size_t start, size_t stop, std::string &out) const;
+    std::string_view view_range(size_t start, size_t stop, std::string &scratch) const;
+    std::optional<std::string_view> next_line_view(std::string &scratch);
+    std::optional<std::string_view> prev_line_view(std::string &scratch);
+    void write_file(BufferSnapshot snapshot, std::string path, bool same_file);
+    void replay_record(const Journal::Record &record);
+    void set_journal_base(const std::vector<std::string_view> &spans);
+    void extend_journal_base(std::string_view span);
+    std::optional<size_t> find_in_journal_base(const char *data, size_t length) const;
+    std::vector<Journal::Record> journal_records() const;
+    void compact_journal();
+    void rebase_journal();
+    void reload_file();
+    void note_change(size_t offset, size_t removed, size_t inserted);
+    size_t line_at(size_t offset) const;
+    std::optional<size_t> scan_line_offset(size_t line) const;
+    size_t piece_line_offset(const Piece &piece, size_t n) const;
 public:
     TextBuffer() {}
     ~TextBuffer();
-    TextBuffer(callable_t cb) : callback(cb) {}
 
-    void register_callback(callable_t cb);
+    // Every registered change callback gets called, in order
+    void register_change_callback(change_callable_t cb);
+    void register_index_callback(index_callable_t cb);
+    void register_save_callback(progress_callable_t cb);
+    void register_decompress_callback(progress_callable_t cb);
+    void register_reload_callback(reload_callable_t cb);
 
     void load_file(std::string filepath);
 
+    // Takes effect on the next `load_file`. Sparse indexes never use more
+    // than `memory_cap` bytes, at the cost of scanning on every lookup.
+    void set_index_mode(LineIndex::Mode mode, size_t memory_cap = 0);
+
+    // A consistent copy of the document as it is right now, which other
+    // threads can go on reading however the buffer changes afterwards
+    BufferSnapshot snapshot() const;
+
+    // Saving happens on a background thread, and never blocks for longer
+    // than it takes to take a snapshot
+    bool save_file(std::string path = "");
+    void wait_for_save();
+    bool is_saving();
+    bool is_modified();
+
+    // Follow mode appends whatever gets written to the end of the file on
+    // disk, like `tail -f`. Polling reads the new bytes, if there are any.
+    bool follow(bool enable);
+    bool is_following();
+    size_t poll_follow();
+
+    // Swaps in however much has been decompressed so far, so it can be
+    // read before the rest is done
+    bool sync_decompressed();
+
+    // Swaps the decompressed file in once the decompression thread is done
+    bool finish_decompressing();
+    void stop_decompressing();
+    bool is_decompressing();
+
+    LineEnding get_line_ending();
+
+    bool sync_index();
+    void stop_indexing();
+    bool is_indexing();
+    size_t line_count();
+
+    // Where line `line` starts, or nothing if there aren't that many lines.
+    // Lines past how far indexing has got are found by scanning for them.
+    std::optional<size_t> line_offset(size_t line) const;
+
     void seek_line(unsigned int line);
     void set_max_buffer_height(unsigned int height);
     void inc_start_line();
@@ -33,9 +287,26 @@ public:
     void dec_start_line();
     void dec_stop_line();
 
+    void set_cursor(size_t offset);
+    size_t get_cursor();
+    size_t size();
+
+    // Edits between these are reported as a single change. Every edit is
+    // its own transaction otherwise.
+    void begin_transaction();
+    void end_transaction();
+
     void append_text(std::string text);
     void insert_text(std::string text);
+    void erase_text(size_t count);
 
     std::optional<std::string> read_prev_line();
     std::optional<std::string> read_next_line();
+
+    // These return views straight into the buffer's storage rather than
+    // copies. A view stays valid until the buffer is modified, or until the
+    // next call to the same function.
+    std::optional<std::string_view> read_prev_line_view();
+    std::optional<std::string_view> read_next_line_view();
+    std::span<const std::string_view> read_lines(unsigned int first_line, size_t count);
 };
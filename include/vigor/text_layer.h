@@ -1,11 +1,15 @@
 #pragma once
 #include <glm/glm.hpp>
 
+#include "buffer_search.h"
 #include "text_buffer.h"
 #include "layer.h"
 
 #include <iostream>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
 
 using std::string;
 
@@ -14,48 +18,119 @@ struct Glyph {
     glm::ivec2   size;       // Size of glyph
     glm::ivec2   bearing;    // Offset from baseline to left/top of glyph
     unsigned int advance;    // Horizontal offset to advance to next glyph
-    glm::vec2 uv_start;
-    glm::vec2 uv_stop;
+    glm::ivec2 atlas_position; // Top left of the glyph in the atlas, in pixels
+    GLushort id;             // Index into the glyph metrics buffer
+};
+
+// Everything the vertex shader needs to draw one cell of the grid. The quad
+// itself is worked out from the glyph's metrics, which live on the GPU.
+struct CellInstance {
+    GLushort column;
+    GLushort row;            // Position in the ring, see `vertical_char_offset`
+    GLushort glyph;
+    GLushort style;
+};
+
+// All the grid renderer needs to know about a cell. Where it is on screen
+// comes from where it is in the texture.
+struct GridCell {
+    GLushort glyph;
+    GLushort style;
+};
+
+enum CellStyle {
+    DefaultStyle,
+    MatchStyle,              // Part of a search match
+    StyleCount,
+};
+
+// Instanced rendering draws a quad for every cell. Grid rendering uploads
+// just the glyph and style of each cell as a texture, and a single full
+// screen pass looks them up in the atlas. That costs next to nothing on the
+// CPU, but only suits monospace fonts, and glyphs can't spill more than a
+// row down out of their cell.
+enum TextRenderMode {
+    InstancedRender,
+    GridRender,
 };
 
 class TextLayer : public Layer {
     private:
-        GLuint vbo_vertices = 0;
-        GLuint vbo_colors = 0;
-        GLuint vbo_uvs = 0;
-        GLuint ibo_faces = 0;
+        TextRenderMode render_mode = InstancedRender;
+
+        GLuint vao = 0;
+        GLuint vbo_instances = 0;
+        GLuint grid_texture_id = 0;
+
+        // The size of the grid the instance buffer or grid texture was last
+        // allocated for
+        unsigned int uploaded_columns = 0;
+        unsigned int uploaded_rows = 0;
 
         GLuint atlas_texture_id = 0;
+        GLuint glyph_metrics_buffer = 0;
+        GLuint glyph_metrics_texture_id = 0;
         unsigned int atlas_width = 0;
         unsigned int atlas_height = 0;
 
         float x = 0.0f;
         float y = 0.0f;
-        float last_y = 1.0f;
+        // Which row of the ring is at the top of the screen. Rows are numbered
+        // continuously, so this goes up and down as the view scrolls, and a
+        // row lives in slot `row % rows` of the cell storage.
         int vertical_char_offset = 0;
         float scale = 0.5f;
         string text;
 
+        // The line being laid out, decoded from UTF-8
+        std::u32string codepoints;
+
         unsigned int columns = 80;
         unsigned int rows = 24;
         unsigned int char_count = 80 * 24;
         int start_line = 0;
+
+        // The start line the ring was last laid out for
         int last_start_line = 0;
-        float *vertices = nullptr;
-        float *uvs = nullptr;
-        float *colors = nullptr;
-        GLushort *faces = nullptr;
+        CellInstance *instances = nullptr;
+        GridCell *grid_cells = nullptr;
+
+        // One per row of the ring, set when the row is laid out and cleared
+        // once it's been uploaded
+        std::vector<bool> dirty_rows;
 
         TextBuffer *buffer = nullptr;
 
+        // Matches on the rows being laid out get highlighted. These are
+        // looked up once per batch of rows, then turned into codepoint
+        // ranges one row at a time.
+        BufferSearch *search = nullptr;
+        std::vector<SearchMatch> row_matches;
+        std::vector<std::pair<size_t, size_t>> match_ranges;
+
         std::string font_path;
         int font_height = 0;
 
-        int top_line_idx = 0;
-        unsigned int bottom_line_idx = 0;
+        // Set when every row needs laying out again, like when a buffer
+        // change touches any of the lines on screen
+        bool lines_dirty = true;
+
+        unsigned int ring_slot(int row);
+        void layout_rows(unsigned int first_line, int first_row, unsigned int count);
+        void layout_row(std::string_view line, int row, std::span<const SearchMatch> matches);
+        void upload_instances();
+        void upload_grid();
+        void draw_instanced();
+        void draw_grid();
+        void handle_buffer_change(const BufferChange &change);
     public:
         TextLayer() {};
 
+        // Has to be set before the layer is set up, and the layer added to
+        // the matching shader
+        void set_render_mode(TextRenderMode mode);
+        TextRenderMode get_render_mode();
+
         void set_font(string font_path, int font_height);
         bool rasterize_font();
         void setup();
@@ -68,7 +143,13 @@ class TextLayer : public Layer {
         void allocate_attribute_buffers();
         void calculate_attribute_buffers();
         void bind_text_buffer(TextBuffer *buffer);
+        void bind_search(BufferSearch *search);
+
+        // Lays every row out again on the next update, for when something
+        // other than the buffer changes how they look
+        void refresh_lines();
 
         void set_start_line(unsigned int line_num);
         unsigned int get_start_line();
+        unsigned int get_rows();
 };
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// UTF-8 validation and decoding. Like the newline scanners, these use AVX2
+// when the CPU has it. Text is mostly ASCII, so 32 byte blocks of pure ASCII
+// skip all of the actual decoding.
+
+// The codepoint invalid sequences are decoded as
+static const char32_t replacement_character = 0xFFFD;
+
+// Returns true if every byte in `data` is ASCII
+bool is_ascii(const char *data, size_t length);
+
+// Returns true if `data` is entirely valid UTF-8 (no overlong encodings,
+// surrogates or codepoints past U+10FFFF, and no truncated sequences)
+bool validate_utf8(const char *data, size_t length);
+
+// Appends the UTF-8 encoding of `codepoint` to `out`
+void encode_utf8(char32_t codepoint, std::string &out);
+
+// How many codepoints `decode_utf8` would turn `data` into
+size_t count_codepoints(const char *data, size_t length);
+
+// Replaces the contents of `out` with the codepoints in `data`. Every invalid
+// byte comes out as `replacement_character`, so nothing is ever dropped.
+void decode_utf8(const char *data, size_t length, std::u32string &out);
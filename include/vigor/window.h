@@ -35,6 +35,7 @@ class Window {
         static void global_cursor_pos_callback(GLFWwindow *window, double x_pos, double y_pos);
         static void global_window_size_callback(GLFWwindow *window, int width, int height);
         static void global_key_event_callback(GLFWwindow *window, int key, int scancode, int action, int mods);
+        static void global_char_event_callback(GLFWwindow *window, unsigned int codepoint);
     public:
         Window(string window_title, int initial_width, int initial_height);
         ~Window();
@@ -1,18 +1,38 @@
-uniform mat4 model;
-//uniform mat4 view;
-//uniform mat4 projection;
+uniform sampler2D atlas;
+uniform isamplerBuffer glyph_metrics;
+uniform vec4 style_colors[2]; // One per `CellStyle`
+uniform vec2 screen_size;
+uniform vec2 cell_size;
+uniform uint first_row;
 
-in vec2 vertex;
-in vec2 tex_coord;
-in vec4 color;
+// Column, row, glyph and style of the cell
+in uvec4 cell;
 
 out vec2 v_uv;
 out vec4 v_color;
 
 void main() {
-    v_uv = tex_coord.xy;
-    v_color = color;
+    // The four corners of the quad, as a triangle strip
+    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);
 
-    //gl_Position = projection * view * model * vertex;
-    gl_Position = model * vec4(vertex, 0.0f, 1.0f);
+    // Bearing and size, then the glyph's corners in the atlas, all in pixels
+    vec4 metrics = vec4(texelFetch(glyph_metrics, 2 * int(cell.z)));
+    vec4 uv = vec4(texelFetch(glyph_metrics, 2 * int(cell.z) + 1)) / vec2(textureSize(atlas, 0)).xyxy;
+
+    // Rows wrap around at 16 bits, same as the instances
+    uint row = (cell.y - first_row) & 0xFFFFu;
+
+    // Work in pixels down from the top left, then flip into clip space
+    vec2 baseline = vec2(float(cell.x) * cell_size.x, float(row + 1u) * cell_size.y);
+    vec2 position = baseline + vec2(metrics.x, -metrics.y) + corner * metrics.zw;
+
+    v_uv = mix(uv.xy, uv.zw, corner);
+    v_color = style_colors[cell.w];
+
+    gl_Position = vec4(
+        2.0f * position.x / screen_size.x - 1.0f,
+        1.0f - 2.0f * position.y / screen_size.y,
+        0.0f,
+        1.0f
+    );
 }
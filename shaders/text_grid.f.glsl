@@ -0,0 +1,59 @@
+uniform sampler2D atlas;
+uniform isamplerBuffer glyph_metrics;
+uniform usampler2D cells;
+uniform vec4 style_colors[2]; // One per `CellStyle`
+uniform vec2 cell_size;
+uniform int top_row;
+
+in vec2 v_position;
+
+out vec4 frag_color;
+
+// How much of the glyph in `cell` (a row and column on screen) covers this
+// pixel, along with the color it's drawn in
+float coverage(ivec2 cell, out vec4 color) {
+    ivec2 grid_size = textureSize(cells, 0);
+    color = vec4(0.0f);
+
+    if (cell.x < 0 || cell.y < 0 || cell.x >= grid_size.x || cell.y >= grid_size.y) {
+        return 0.0f;
+    }
+
+    // Rows of the texture are a ring, starting at `top_row`
+    uvec2 glyph = texelFetch(cells, ivec2(cell.x, (cell.y + top_row) % grid_size.y), 0).rg;
+
+    // Bearing and size, then the glyph's corners in the atlas, all in pixels
+    vec4 metrics = vec4(texelFetch(glyph_metrics, 2 * int(glyph.x)));
+    vec4 uv = vec4(texelFetch(glyph_metrics, 2 * int(glyph.x) + 1)) / vec2(textureSize(atlas, 0)).xyxy;
+
+    if (metrics.z <= 0.0f || metrics.w <= 0.0f) {
+        return 0.0f;
+    }
+
+    vec2 baseline = vec2(cell.x, cell.y + 1) * cell_size;
+    vec2 within = (v_position - baseline - vec2(metrics.x, -metrics.y)) / metrics.zw;
+
+    if (any(lessThan(within, vec2(0.0f))) || any(greaterThan(within, vec2(1.0f)))) {
+        return 0.0f;
+    }
+
+    color = style_colors[glyph.y];
+    return texture(atlas, mix(uv.xy, uv.zw, within)).r;
+}
+
+void main() {
+    ivec2 cell = ivec2(floor(v_position / cell_size));
+
+    // Baselines sit on the bottom of the cell, so descenders hang down into
+    // the row below. Those pixels need to check the cell above them too.
+    vec4 color, above_color;
+    float a = coverage(cell, color);
+    float above = coverage(cell - ivec2(0, 1), above_color);
+
+    if (above > a) {
+        a = above;
+        color = above_color;
+    }
+
+    frag_color = vec4(color.rgb, color.a * a);
+}
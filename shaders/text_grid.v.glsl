@@ -0,0 +1,12 @@
+uniform vec2 screen_size;
+
+// Pixels down from the top left
+out vec2 v_position;
+
+void main() {
+    // One triangle twice the size of the screen, so it covers all of it
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+
+    v_position = corner * screen_size;
+    gl_Position = vec4(2.0f * corner.x - 1.0f, 1.0f - 2.0f * corner.y, 0.0f, 1.0f);
+}
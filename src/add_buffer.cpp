@@ -0,0 +1,63 @@
+#include "vigor/add_buffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+void AddBuffer::clear() {
+    // Anyone else holding on to the old blocks gets to keep them
+    this->blocks = std::make_shared<std::vector<Block>>();
+    this->used = 0;
+}
+
+size_t AddBuffer::append(std::string_view text) {
+    // Text never straddles blocks, so a big paste gets a block of its own
+    if (this->blocks->empty() || this->blocks->back().capacity - this->used < text.size()) {
+        size_t start = 0;
+
+        if (!this->blocks->empty()) {
+            start = this->blocks->back().start + this->blocks->back().capacity + 1;
+        }
+
+        // A copy might be reading the list right now
+        if (this->blocks.use_count() > 1) {
+            this->blocks = std::make_shared<std::vector<Block>>(*this->blocks);
+        } else {
+            // Same as PieceTree::own, pairs with the release of a copy let
+            // go of on another thread
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+
+        size_t capacity = std::max(block_size, text.size());
+        this->blocks->push_back({start, capacity, std::make_shared<char[]>(capacity)});
+        this->used = 0;
+    }
+
+    Block &block = this->blocks->back();
+    size_t offset = block.start + this->used;
+
+    memcpy(block.data.get() + this->used, text.data(), text.size());
+    this->used += text.size();
+
+    return offset;
+}
+
+const char *AddBuffer::data(size_t offset) const {
+    // Nearly everything lives in the last block
+    const Block &last = this->blocks->back();
+
+    if (offset >= last.start) {
+        return last.data.get() + (offset - last.start);
+    }
+
+    auto next = std::upper_bound(
+        this->blocks->begin(),
+        this->blocks->end(),
+        offset,
+        [](size_t value, const Block &block) { return value < block.start; });
+
+    const Block &block = *(next - 1);
+    return block.data.get() + (offset - block.start);
+}
@@ -0,0 +1,641 @@
+#include "vigor/global.h"
+#include "vigor/buffer_search.h"
+#include "vigor/line_scanner.h"
+#include "vigor/literal_scanner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Spans are searched this much at a time, so a big unedited file (which is
+// all one span) can still be stopped partway through. Chunks are small
+// enough to still be in cache when their lines get counted.
+static const size_t search_chunk_size = 1 << 20;
+
+// Progress is only reported every so often
+static const size_t search_progress_size = 64 << 20;
+
+// Regex workers get chunks of about this much, rounded out to whole lines
+static const size_t regex_chunk_size = 1 << 20;
+
+// RE2 falls back to a slower (but still linear) matcher rather than go over
+// its memory budget, so this only bounds how much each regex can take
+static const int64_t regex_max_mem = 64 << 20;
+
+BufferSearch::~BufferSearch() {
+    // Every search waits for its work, so there's none left once they've
+    // all stopped
+    this->stop();
+
+    {
+        std::lock_guard<std::mutex> lock(this->work_mutex);
+        this->stop_workers = true;
+    }
+
+    this->work_ready.notify_all();
+
+    for (std::thread &worker : this->workers) {
+        worker.join();
+    }
+}
+
+void BufferSearch::register_match_callback(match_callable_t cb) {
+    this->match_callback = cb;
+}
+
+void BufferSearch::register_progress_callback(progress_callable_t cb) {
+    this->progress_callback = cb;
+}
+
+bool BufferSearch::start(
+    BufferSnapshot snapshot,
+    std::string needle,
+    SearchMode mode,
+    size_t from_offset,
+    size_t from_line,
+    size_t visible_lines) {
+    // Whatever we were searching for is out of date now. Matches are only
+    // added while their search hasn't been stopped, and both happen under
+    // the match lock, so nothing from the old search can turn up after this.
+    {
+        std::lock_guard<std::mutex> lock(this->match_mutex);
+
+        if (this->job) {
+            this->job->stop = true;
+            this->stopped_jobs.push_back(std::move(this->job));
+        }
+
+        this->wrapped_matches.clear();
+        this->matches.clear();
+        this->found_first = false;
+    }
+
+    this->reap_stopped_jobs();
+
+    this->needle = std::move(needle);
+    this->mode = mode;
+
+    if (this->needle.empty()) {
+        return true;
+    }
+
+    auto job = std::make_unique<SearchJob>();
+    job->needle = this->needle;
+    job->mode = mode;
+
+    if (mode == Regex) {
+        RE2::Options options;
+        options.set_log_errors(false);
+        options.set_max_mem(regex_max_mem);
+
+        job->regex = std::make_unique<RE2>(this->needle, options);
+
+        if (!job->regex->ok()) {
+            PLOGW << "Invalid regex \"" << this->needle << "\": " << job->regex->error();
+            return false;
+        }
+    }
+
+    job->thread = std::thread(&BufferSearch::search, this, std::ref(*job), std::move(snapshot), from_offset, from_line, visible_lines);
+    this->job = std::move(job);
+
+    return true;
+}
+
+void BufferSearch::stop() {
+    {
+        std::lock_guard<std::mutex> lock(this->match_mutex);
+
+        if (this->job) {
+            this->job->stop = true;
+            this->stopped_jobs.push_back(std::move(this->job));
+        }
+    }
+
+    for (std::unique_ptr<SearchJob> &job : this->stopped_jobs) {
+        job->thread.join();
+    }
+
+    this->stopped_jobs.clear();
+}
+
+void BufferSearch::reap_stopped_jobs() {
+    // Only the ones that are already done, so this never blocks
+    std::erase_if(this->stopped_jobs, [](std::unique_ptr<SearchJob> &job) {
+        if (!job->done) {
+            return false;
+        }
+
+        job->thread.join();
+        return true;
+    });
+}
+
+void BufferSearch::queue_work(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(this->work_mutex);
+
+        // Nothing's started until the first regex search
+        if (this->workers.empty()) {
+            unsigned int count = std::max(1u, std::thread::hardware_concurrency());
+
+            for (unsigned int i = 0; i < count; ++i) {
+                this->workers.emplace_back(&BufferSearch::run_worker, this);
+            }
+        }
+
+        this->work.push_back(std::move(task));
+    }
+
+    this->work_ready.notify_one();
+}
+
+void BufferSearch::run_worker() {
+    std::unique_lock<std::mutex> lock(this->work_mutex);
+
+    while (true) {
+        this->work_ready.wait(lock, [this]() { return this->stop_workers || !this->work.empty(); });
+
+        if (this->work.empty()) {
+            break;
+        }
+
+        std::function<void()> task = std::move(this->work.front());
+        this->work.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+bool BufferSearch::is_searching() {
+    return this->job && !this->job->done;
+}
+
+void BufferSearch::search(SearchJob &job, BufferSnapshot snapshot, size_t from_offset, size_t from_line, size_t visible_lines) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    size_t size = snapshot.size();
+    size_t searched = 0;
+    from_offset = std::min(from_offset, size);
+
+    bool finished;
+
+    if (job.mode == Regex) {
+        finished = this->search_regex(job, snapshot, from_offset, from_line, visible_lines);
+    } else {
+        // Whatever's on screen and below it first, then whatever's above it
+        finished = this->search_range(job, snapshot, from_offset, size, from_line, this->matches, searched, size)
+            && this->search_range(job, snapshot, 0, from_offset, 0, this->wrapped_matches, searched, size);
+    }
+
+    job.done = true;
+
+    // A stopped search has nothing left to say, there's already another one
+    // (or none at all) by now
+    if (!finished || job.stop) {
+        return;
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
+
+    PLOGI << "Found " << this->match_count() << " matches for \"" << job.needle << "\" in " << duration.count() << "ms";
+
+    if (this->progress_callback) {
+        this->progress_callback(1.0f, true);
+    }
+}
+
+bool BufferSearch::search_range(
+    SearchJob &job,
+    const BufferSnapshot &snapshot,
+    size_t start,
+    size_t stop,
+    size_t line,
+    std::vector<SearchMatch> &out,
+    size_t &searched,
+    size_t total) {
+    if (start >= stop) {
+        return true;
+    }
+
+    // Matches are handed over a chunk at a time, so the lock is hardly held
+    std::vector<SearchMatch> found;
+    size_t needle_length = job.needle.size();
+
+    // Matches have to start before `stop`, but they're allowed to run past it
+    size_t read_stop = std::min(stop + needle_length - 1, snapshot.size());
+
+    // A match can straddle two chunks (or several, if they're tiny), so
+    // the last few bytes of each are carried over and searched together
+    // with the start of the next. Lines are only counted up to the start
+    // of the carry, since a match might still turn up inside of it.
+    std::string carry;
+    std::string boundary;
+    size_t counted = start;
+    size_t line_start = start;
+
+    auto count_lines = [&](const char *data, size_t length) {
+        size_t newlines = count_newlines(data, length);
+
+        if (newlines > 0) {
+            line += newlines;
+            line_start = counted + (find_last_newline(data, length) - data) + 1;
+        }
+
+        counted += length;
+    };
+
+    // Counts lines up to `target`, some of which might still be in the carry
+    auto count_to = [&](size_t target, std::string_view chunk, size_t chunk_start) {
+        if (counted < chunk_start) {
+            const char *data = carry.data() + carry.size() - (chunk_start - counted);
+            count_lines(data, std::min(target, chunk_start) - counted);
+        }
+
+        if (target > counted) {
+            count_lines(chunk.data() + (counted - chunk_start), target - counted);
+        }
+    };
+
+    // Matches never overlap, so the next one can't start before `resume`
+    size_t resume = start;
+
+    auto add_match = [&](size_t offset, std::string_view chunk, size_t chunk_start) {
+        count_to(offset, chunk, chunk_start);
+        found.push_back({offset, line, offset - line_start, needle_length});
+        resume = offset + needle_length;
+    };
+
+    auto resume_in = [&](std::string_view data, size_t data_start) {
+        return data.data() + std::min(std::max(resume, data_start) - data_start, data.size());
+    };
+
+    size_t span_start = 0;
+
+    for (std::string_view span : snapshot.spans()) {
+        size_t span_stop = span_start + span.size();
+        size_t clip_start = std::max(span_start, start);
+        size_t clip_stop = std::min(span_stop, read_stop);
+
+        for (size_t chunk_start = clip_start; chunk_start < clip_stop; chunk_start += search_chunk_size) {
+            if (job.stop) {
+                return false;
+            }
+
+            std::string_view chunk = span.substr(chunk_start - span_start, std::min(search_chunk_size, clip_stop - chunk_start));
+            size_t chunk_stop = chunk_start + chunk.size();
+
+            // Anything found starting in the carry has to end in this chunk,
+            // since the carry is always shorter than the needle
+            if (!carry.empty()) {
+                boundary.assign(carry);
+                boundary.append(chunk.substr(0, needle_length - 1));
+
+                size_t boundary_start = chunk_start - carry.size();
+                const char *end = boundary.data() + boundary.size();
+
+                for (const char *hit = resume_in(boundary, boundary_start); (hit = find_literal(hit, end - hit, job.needle)); hit += needle_length) {
+                    size_t pos = hit - boundary.data();
+
+                    if (pos >= carry.size()) {
+                        break;
+                    }
+
+                    add_match(boundary_start + pos, chunk, chunk_start);
+                }
+            }
+
+            const char *end = chunk.data() + chunk.size();
+
+            for (const char *hit = resume_in(chunk, chunk_start); (hit = find_literal(hit, end - hit, job.needle)); hit += needle_length) {
+                add_match(chunk_start + (hit - chunk.data()), chunk, chunk_start);
+            }
+
+            // Count everything that isn't about to be carried over, and only
+            // then replace the carry, since the counting might still need it
+            size_t carry_size = std::min(needle_length - 1, carry.size() + chunk.size());
+            count_to(chunk_stop - carry_size, chunk, chunk_start);
+
+            if (chunk.size() >= carry_size) {
+                carry.assign(chunk.substr(chunk.size() - carry_size));
+            } else {
+                carry.append(chunk);
+                carry.erase(0, carry.size() - carry_size);
+            }
+
+            this->add_matches(job, out, found);
+
+            // The bytes read past `stop` are the next range's to report
+            size_t count = std::min(chunk_stop, stop) - std::min(chunk_start, stop);
+
+            if (searched / search_progress_size != (searched + count) / search_progress_size && this->progress_callback && !job.stop) {
+                this->progress_callback(float(searched + count) / total, false);
+            }
+
+            searched += count;
+        }
+
+        span_start = span_stop;
+
+        if (span_start >= read_stop) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+bool BufferSearch::search_regex(SearchJob &job, const BufferSnapshot &snapshot, size_t from_offset, size_t from_line, size_t visible_lines) {
+    size_t size = snapshot.size();
+
+    // The lines on screen go first, in a chunk of their own so they're done
+    // as soon as possible, then the rest of the document from there on, then
+    // everything before it
+    size_t visible_stop = from_offset;
+
+    for (size_t i = 0; i < visible_lines && visible_stop < size; ++i) {
+        visible_stop = snapshot.next_line_start(visible_stop + 1);
+    }
+
+    std::vector<RegexChunk> chunks;
+
+    auto add_chunks = [&](size_t start, size_t stop, bool wrapped) {
+        while (start < stop) {
+            size_t chunk_stop = std::min(snapshot.next_line_start(start + regex_chunk_size), stop);
+            chunks.emplace_back(start, chunk_stop, wrapped);
+            start = chunk_stop;
+        }
+    };
+
+    if (visible_stop > from_offset) {
+        chunks.emplace_back(from_offset, visible_stop, false);
+    }
+
+    add_chunks(visible_stop, size, false);
+    add_chunks(0, from_offset, true);
+
+    // Workers take chunks in order, and results are merged in the same order
+    // as they come in, so they can be handed over as they're found while
+    // staying sorted
+    std::mutex chunk_mutex;
+    std::condition_variable chunk_done;
+    std::atomic<size_t> next_chunk = 0;
+
+    // Everything the workers touch lives here, so we can't return before
+    // every one of them has finished
+    unsigned int running = 0;
+
+    auto worker = [&]() {
+        std::string scratch;
+        size_t idx;
+
+        while (!job.stop && (idx = next_chunk++) < chunks.size()) {
+            this->search_regex_chunk(job, snapshot, chunks[idx], scratch);
+
+            if (job.stop) {
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(chunk_mutex);
+            chunks[idx].done = true;
+            chunk_done.notify_one();
+        }
+
+        // Make sure the merging below notices we've been stopped
+        std::lock_guard<std::mutex> lock(chunk_mutex);
+        running--;
+        chunk_done.notify_one();
+    };
+
+    unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+    thread_count = std::min<size_t>(thread_count, std::max<size_t>(chunks.size(), 1));
+    running = thread_count;
+
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        this->queue_work(worker);
+    }
+
+    size_t merged = 0;
+    size_t searched = 0;
+    size_t line = from_line;
+
+    while (merged < chunks.size()) {
+        {
+            std::unique_lock<std::mutex> lock(chunk_mutex);
+            chunk_done.wait(lock, [&]() { return job.stop || chunks[merged].done; });
+        }
+
+        if (job.stop) {
+            break;
+        }
+
+        // Only now that every chunk before this one has been merged do we
+        // know which line it starts on
+        RegexChunk &chunk = chunks[merged];
+
+        if (chunk.wrapped && (merged == 0 || !chunks[merged - 1].wrapped)) {
+            line = 0;
+        }
+
+        for (SearchMatch &match : chunk.matches) {
+            match.line += line;
+        }
+
+        line += chunk.newlines;
+        this->add_matches(job, chunk.wrapped ? this->wrapped_matches : this->matches, chunk.matches);
+
+        size_t count = chunk.stop - chunk.start;
+
+        if (searched / search_progress_size != (searched + count) / search_progress_size && this->progress_callback && !job.stop) {
+            this->progress_callback(float(searched + count) / size, false);
+        }
+
+        searched += count;
+        merged++;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(chunk_mutex);
+        chunk_done.wait(lock, [&]() { return running == 0; });
+    }
+
+    return merged == chunks.size();
+}
+
+void BufferSearch::search_regex_chunk(SearchJob &job, const BufferSnapshot &snapshot, RegexChunk &chunk, std::string &scratch) {
+    std::string_view text = snapshot.view_range(chunk.start, chunk.stop, scratch);
+    const char *cursor = text.data();
+    const char *end = text.data() + text.size();
+    size_t line = 0;
+
+    while (cursor < end) {
+        const char *newline = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+        const char *line_end = newline ? newline : end;
+
+        // Line views never include the '\r' of a CRLF, so neither do matches
+        if (line_end > cursor && line_end[-1] == '\r') {
+            line_end--;
+        }
+
+        re2::StringPiece input(cursor, line_end - cursor);
+        re2::StringPiece match;
+        size_t pos = 0;
+
+        while (pos <= input.size() && job.regex->Match(input, pos, input.size(), RE2::UNANCHORED, &match, 1)) {
+            size_t column = match.data() - input.data();
+
+            // Empty matches are valid, but there's nothing there to show
+            if (match.empty()) {
+                pos = column + 1;
+                continue;
+            }
+
+            size_t offset = chunk.start + (cursor - text.data()) + column;
+            chunk.matches.push_back({offset, line, column, match.size()});
+            pos = column + match.size();
+        }
+
+        if (!newline || job.stop) {
+            break;
+        }
+
+        cursor = newline + 1;
+        line++;
+    }
+
+    chunk.newlines = line;
+}
+
+void BufferSearch::add_matches(SearchJob &job, std::vector<SearchMatch> &out, std::vector<SearchMatch> &found) {
+    if (found.empty()) {
+        return;
+    }
+
+    bool first;
+
+    {
+        std::lock_guard<std::mutex> lock(this->match_mutex);
+
+        if (job.stop) {
+            found.clear();
+            return;
+        }
+
+        out.insert(out.end(), found.begin(), found.end());
+        first = !this->found_first;
+        this->found_first = true;
+    }
+
+    // Searching starts at the viewport, so the first match is the nearest
+    if (first && this->match_callback) {
+        this->match_callback(found.front());
+    }
+
+    found.clear();
+}
+
+std::string_view BufferSearch::get_needle() {
+    return this->needle;
+}
+
+size_t BufferSearch::match_count() {
+    std::lock_guard<std::mutex> lock(this->match_mutex);
+    return this->wrapped_matches.size() + this->matches.size();
+}
+
+std::optional<SearchMatch> BufferSearch::get_match(size_t index) {
+    std::lock_guard<std::mutex> lock(this->match_mutex);
+
+    if (index < this->wrapped_matches.size()) {
+        return this->wrapped_matches[index];
+    }
+
+    index -= this->wrapped_matches.size();
+
+    if (index < this->matches.size()) {
+        return this->matches[index];
+    }
+
+    return {};
+}
+
+void BufferSearch::matches_in_lines(size_t first_line, size_t count, std::vector<SearchMatch> &out) {
+    std::lock_guard<std::mutex> lock(this->match_mutex);
+
+    out.clear();
+
+    for (const std::vector<SearchMatch> *list : {&this->wrapped_matches, &this->matches}) {
+        auto first = std::partition_point(list->begin(), list->end(), [first_line](const SearchMatch &match) {
+            return match.line < first_line;
+        });
+
+        for (auto match = first; match != list->end() && match->line < first_line + count; ++match) {
+            out.push_back(*match);
+        }
+    }
+}
+
+std::optional<SearchMatch> BufferSearch::nearest_match() {
+    std::lock_guard<std::mutex> lock(this->match_mutex);
+
+    if (!this->matches.empty()) {
+        return this->matches.front();
+    } else if (!this->wrapped_matches.empty()) {
+        return this->wrapped_matches.front();
+    }
+
+    return {};
+}
+
+std::optional<SearchMatch> BufferSearch::next_match(size_t line) {
+    std::lock_guard<std::mutex> lock(this->match_mutex);
+
+    for (const std::vector<SearchMatch> *list : {&this->wrapped_matches, &this->matches}) {
+        auto next = std::partition_point(list->begin(), list->end(), [line](const SearchMatch &match) {
+            return match.line <= line;
+        });
+
+        if (next != list->end()) {
+            return *next;
+        }
+    }
+
+    // Nothing further down, so wrap around to the top
+    if (!this->wrapped_matches.empty()) {
+        return this->wrapped_matches.front();
+    } else if (!this->matches.empty()) {
+        return this->matches.front();
+    }
+
+    return {};
+}
+
+std::optional<SearchMatch> BufferSearch::prev_match(size_t line) {
+    std::lock_guard<std::mutex> lock(this->match_mutex);
+
+    for (const std::vector<SearchMatch> *list : {&this->matches, &this->wrapped_matches}) {
+        auto next = std::partition_point(list->begin(), list->end(), [line](const SearchMatch &match) {
+            return match.line < line;
+        });
+
+        if (next != list->begin()) {
+            return *(next - 1);
+        }
+    }
+
+    // Nothing further up, so wrap around to the bottom
+    if (!this->matches.empty()) {
+        return this->matches.back();
+    } else if (!this->wrapped_matches.empty()) {
+        return this->wrapped_matches.back();
+    }
+
+    return {};
+}
@@ -0,0 +1,108 @@
+#include "vigor/global.h"
+#include "vigor/buffer_snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+const char *BufferSnapshot::piece_data(const Piece &piece) const {
+    if (piece.source == Original) {
+        return this->original + piece.start;
+    } else {
+        return this->added.data(piece.start);
+    }
+}
+
+size_t BufferSnapshot::get_version() const {
+    return this->version;
+}
+
+size_t BufferSnapshot::size() const {
+    return this->pieces.length();
+}
+
+size_t BufferSnapshot::line_count() const {
+    return this->pieces.newlines() + 1;
+}
+
+void BufferSnapshot::read_range(size_t start, size_t stop, std::string &out) const {
+    stop = std::min(stop, this->pieces.length());
+
+    out.clear();
+
+    if (start >= stop) {
+        return;
+    }
+
+    PieceTree::Location loc = this->pieces.find_offset(start);
+    size_t inner = loc.offset;
+
+    out.reserve(stop - start);
+
+    for (size_t idx = loc.index; start < stop; ++idx, inner = 0) {
+        const Piece &piece = this->pieces.at(idx);
+        size_t count = std::min(piece.length - inner, stop - start);
+
+        out.append(this->piece_data(piece) + inner, count);
+        start += count;
+    }
+}
+
+std::string_view BufferSnapshot::view_range(size_t start, size_t stop, std::string &scratch) const {
+    stop = std::min(stop, this->pieces.length());
+
+    if (start >= stop) {
+        return {};
+    }
+
+    PieceTree::Location loc = this->pieces.find_offset(start);
+    const Piece &piece = this->pieces.at(loc.index);
+
+    if (loc.offset + (stop - start) <= piece.length) {
+        return std::string_view(this->piece_data(piece) + loc.offset, stop - start);
+    }
+
+    this->read_range(start, stop, scratch);
+    return scratch;
+}
+
+size_t BufferSnapshot::next_line_start(size_t offset) const {
+    size_t length = this->pieces.length();
+
+    if (offset == 0 || offset >= length) {
+        return std::min(offset, length);
+    }
+
+    // The byte just before `offset` might be the newline we're after
+    PieceTree::Location loc = this->pieces.find_offset(offset - 1);
+    size_t inner = loc.offset;
+    size_t piece_start = loc.start;
+
+    for (size_t idx = loc.index; idx < this->pieces.count(); ++idx, inner = 0) {
+        const Piece &piece = this->pieces.at(idx);
+        const char *data = this->piece_data(piece);
+        const char *newline = static_cast<const char*>(memchr(data + inner, '\n', piece.length - inner));
+
+        if (newline) {
+            return piece_start + (newline - data) + 1;
+        }
+
+        piece_start += piece.length;
+    }
+
+    return length;
+}
+
+std::vector<std::string_view> BufferSnapshot::spans() const {
+    std::vector<std::string_view> spans;
+    spans.reserve(this->pieces.count());
+
+    for (size_t i = 0; i < this->pieces.count(); ++i) {
+        const Piece &piece = this->pieces.at(i);
+        spans.emplace_back(this->piece_data(piece), piece.length);
+    }
+
+    return spans;
+}
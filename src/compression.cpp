@@ -0,0 +1,176 @@
+#include "vigor/global.h"
+#include "vigor/compression.h"
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+
+// Both sides of the pipeline work in chunks this big
+static const size_t chunk_size = 1 << 20;
+
+Compression detect_compression(const std::string &filepath) {
+    std::FILE *file = std::fopen(filepath.c_str(), "rb");
+
+    if (!file) {
+        return Uncompressed;
+    }
+
+    unsigned char magic[4] = {0};
+    size_t len = std::fread(magic, 1, sizeof(magic), file);
+    std::fclose(file);
+
+    if (len >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) {
+        return Gzip;
+    } else if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD) {
+        return Zstd;
+    }
+
+    return Uncompressed;
+}
+
+const char *compression_name(Compression compression) {
+    switch (compression) {
+    case Gzip:
+        return "gzip";
+    case Zstd:
+        return "zstd";
+    default:
+        return "uncompressed";
+    }
+}
+
+static bool inflate_stream(std::FILE *in, decompress_sink_t &sink) {
+    std::unique_ptr<unsigned char[]> in_chunk(new unsigned char[chunk_size]);
+    std::unique_ptr<unsigned char[]> out_chunk(new unsigned char[chunk_size]);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    // 32 on top of the window bits has zlib look for the gzip header itself
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+        PLOGE << "Failed to initialize zlib";
+        return false;
+    }
+
+    int ret = Z_OK;
+    bool keep_going = true;
+    bool trailing = false;
+
+    while (keep_going && !trailing) {
+        stream.avail_in = std::fread(in_chunk.get(), 1, chunk_size, in);
+        stream.next_in = in_chunk.get();
+
+        if (stream.avail_in == 0) {
+            break;
+        }
+
+        // A full output chunk might mean there's more to come even once the
+        // input has all been used up
+        do {
+            // Files made with something like `cat a.gz b.gz` have more than
+            // one member, which should just come out one after the other
+            if (ret == Z_STREAM_END) {
+                if (stream.avail_in == 0) {
+                    break;
+                }
+
+                // Anything else after a member, like the zero padding some
+                // tools add, just means the data is over, the same as gzip
+                // itself treats it
+                if (stream.next_in[0] != 0x1F || (stream.avail_in > 1 && stream.next_in[1] != 0x8B)) {
+                    PLOGW << "Ignoring trailing data after the end of the compressed stream";
+                    trailing = true;
+                    break;
+                }
+
+                inflateReset(&stream);
+            }
+
+            stream.avail_out = chunk_size;
+            stream.next_out = out_chunk.get();
+
+            ret = inflate(&stream, Z_NO_FLUSH);
+
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                PLOGE << "Failed to inflate: " << (stream.msg ? stream.msg : "unknown error");
+                inflateEnd(&stream);
+                return false;
+            }
+
+            size_t produced = chunk_size - stream.avail_out;
+            keep_going = produced == 0 || sink(reinterpret_cast<const char*>(out_chunk.get()), produced);
+        } while (keep_going && (stream.avail_in > 0 || stream.avail_out == 0));
+    }
+
+    inflateEnd(&stream);
+
+    if (keep_going && ret != Z_STREAM_END) {
+        PLOGE << "Compressed stream ended early";
+        return false;
+    }
+
+    return true;
+}
+
+static bool zstd_stream(std::FILE *in, decompress_sink_t &sink) {
+    size_t in_size = ZSTD_DStreamInSize();
+    size_t out_size = ZSTD_DStreamOutSize();
+    std::unique_ptr<char[]> in_chunk(new char[in_size]);
+    std::unique_ptr<char[]> out_chunk(new char[out_size]);
+
+    ZSTD_DStream *stream = ZSTD_createDStream();
+
+    if (!stream) {
+        PLOGE << "Failed to initialize zstd";
+        return false;
+    }
+
+    ZSTD_initDStream(stream);
+
+    // Zero once a frame has been completely decoded and flushed
+    size_t ret = 0;
+    bool keep_going = true;
+    size_t len;
+
+    while (keep_going && (len = std::fread(in_chunk.get(), 1, in_size, in)) > 0) {
+        ZSTD_inBuffer input = {in_chunk.get(), len, 0};
+
+        while (keep_going && input.pos < input.size) {
+            ZSTD_outBuffer output = {out_chunk.get(), out_size, 0};
+            ret = ZSTD_decompressStream(stream, &output, &input);
+
+            if (ZSTD_isError(ret)) {
+                PLOGE << "Failed to decompress: " << ZSTD_getErrorName(ret);
+                ZSTD_freeDStream(stream);
+                return false;
+            }
+
+            keep_going = output.pos == 0 || sink(out_chunk.get(), output.pos);
+        }
+    }
+
+    ZSTD_freeDStream(stream);
+
+    if (keep_going && ret != 0) {
+        PLOGE << "Compressed stream ended early";
+        return false;
+    }
+
+    return true;
+}
+
+bool decompress_stream(std::FILE *in, Compression compression, decompress_sink_t sink) {
+    switch (compression) {
+    case Gzip:
+        return inflate_stream(in, sink);
+    case Zstd:
+        return zstd_stream(in, sink);
+    default:
+        PLOGE << "Nothing to decompress";
+        return false;
+    }
+}
@@ -1,32 +1,43 @@
 #include "vigor/global.h"
+#include "vigor/buffer_search.h"
 #include "vigor/engine.h"
 #include "vigor/event.h"
 #include "vigor/shader.h"
 #include "vigor/example_layer.h"
 #include "vigor/text_buffer.h"
 #include "vigor/text_layer.h"
+#include "vigor/utf8.h"
 #include "vigor/window.h"
 
+#include <filesystem>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <system_error>
 
 // `_ROOT_DIR` is set via cmake
 std::string ROOT_DIR(_ROOT_DIR);
 
+// A dense line index costs a byte or two per line, which adds up for files
+// in the tens of gigabytes. Files past this size get a sparse index that
+// stays within a fixed budget instead.
+static const uintmax_t sparse_index_threshold = uintmax_t(4) << 30;
+static const size_t sparse_index_memory = 16 << 20;
+
 Shader base_shader(
     ROOT_DIR + "/shaders/base.v.glsl",
     ROOT_DIR + "/shaders/base.f.glsl");
 Shader text_shader(
     ROOT_DIR + "/shaders/text.v.glsl",
     ROOT_DIR + "/shaders/text.f.glsl");
+Shader text_grid_shader(
+    ROOT_DIR + "/shaders/text_grid.v.glsl",
+    ROOT_DIR + "/shaders/text_grid.f.glsl");
 ExampleLayer base_layer;
 TextLayer text_layer;
 
-bool file_write_callback(std::streambuf::int_type c) {
-    return true;
-}
-
-TextBuffer buffer(file_write_callback);
+TextBuffer buffer;
+BufferSearch search;
 
 Engine::Engine() {
 }
@@ -42,15 +53,81 @@ void Engine::pre_window_startup() {
         &base_shader
     }});
 
+    // Grid rendering is cheaper still, but only works if no glyph spills
+    // out of its cell sideways. Switching is just a matter of changing this.
+    text_layer.set_render_mode(InstancedRender);
+
     this->add_outgoing_event({LayerModifyRequest, {
         EVENT_LAYER_ADD,
         &text_layer,
-        &text_shader
+        text_layer.get_render_mode() == GridRender ? &text_grid_shader : &text_shader
     }});
 
-    // Load some lorem ipsum text and bind the text buffer to our text layer
-    buffer.load_file(ROOT_DIR + "/test.txt");
+    // Indexing progress comes in from the indexing thread, so it has to go
+    // through the event queue before anything acts on it
+    buffer.register_index_callback([this](float progress) {
+        this->add_incoming_event({BufferIndexProgress, {progress}});
+    });
+
+    // Same goes for saving, which happens on its own thread
+    buffer.register_save_callback([this](float progress, bool done, bool success) {
+        if (done) {
+            this->add_incoming_event({BufferSaveComplete, {success ? 1 : 0}});
+        } else {
+            this->add_incoming_event({BufferSaveProgress, {progress}});
+        }
+    });
+
+    // Compressed files are decompressed on their own thread too
+    buffer.register_decompress_callback([this](float progress, bool done, bool success) {
+        if (done) {
+            this->add_incoming_event({BufferDecompressComplete, {success ? 1 : 0}});
+        } else {
+            this->add_incoming_event({BufferDecompressProgress, {progress}});
+        }
+    });
+
+    // A followed file that shrinks gets reloaded, which a search still
+    // reading the old one has to be stopped for. It's started over after.
+    buffer.register_reload_callback([this](bool done) {
+        if (done) {
+            this->start_search();
+        } else {
+            search.stop();
+        }
+    });
+
+    // The text layer works out for itself whether a change is on screen
+    buffer.register_change_callback([this](const BufferChange &) {
+        this->add_outgoing_event({LayerUpdateRequest, {}});
+    });
+
+    // Searching happens on its own thread as well. The first match found is
+    // the one nearest the viewport, so that gets shown straight away.
+    search.register_match_callback([this](const SearchMatch &) {
+        this->add_incoming_event({BufferSearchMatch, {}});
+    });
+
+    search.register_progress_callback([this](float progress, bool done) {
+        if (done) {
+            this->add_incoming_event({BufferSearchComplete, {}});
+        } else {
+            this->add_incoming_event({BufferSearchProgress, {progress}});
+        }
+    });
+
+    // Load some lorem ipsum text and bind the text buffer to our text layer.
+    // This only indexes the first screen's worth of lines before returning.
+    std::string path = ROOT_DIR + "/test.txt";
+    std::error_code err;
+
+    if (std::filesystem::file_size(path, err) >= sparse_index_threshold && !err) {
+        buffer.set_index_mode(LineIndex::Sparse, sparse_index_memory);
+    }
+
+    buffer.load_file(path);
     text_layer.bind_text_buffer(&buffer);
+    text_layer.bind_search(&search);
 }
 
 // This must be called after the window has had its `startup` called
@@ -66,12 +143,138 @@ void Engine::post_window_startup() {
     text_layer.set_position(0.0f, 0.0f);
 }
 
+// This must be called before the window and buffer go away
+void Engine::teardown() {
+    search.stop();
+    buffer.stop_indexing();
+    buffer.stop_decompressing();
+    buffer.wait_for_save();
+}
+
 void Engine::handle_key_event(int key, int scancode, int action, int mods) {
+    // Ctrl+S (or Cmd+S) saves without waiting for the write to finish
+    if (key == GLFW_KEY_S && action == GLFW_PRESS && (mods & (GLFW_MOD_CONTROL | GLFW_MOD_SUPER))) {
+        buffer.save_file();
+        return;
+    }
+
+    // Ctrl+T (or Cmd+T) toggles following the file as it grows
+    if (key == GLFW_KEY_T && action == GLFW_PRESS && (mods & (GLFW_MOD_CONTROL | GLFW_MOD_SUPER))) {
+        if (buffer.follow(!buffer.is_following())) {
+            PLOGI << "Following buffer";
+        } else {
+            PLOGI << "Stopped following buffer";
+        }
+        return;
+    }
+
+    // Ctrl+F (or Cmd+F) starts typing something to search for, and with
+    // Shift that something is a regex
+    if (key == GLFW_KEY_F && action == GLFW_PRESS && (mods & (GLFW_MOD_CONTROL | GLFW_MOD_SUPER))) {
+        this->entering_query = true;
+        this->query.clear();
+        this->query_mode = (mods & GLFW_MOD_SHIFT) ? Regex : Literal;
+        PLOGI << (this->query_mode == Regex ? "Find regex: " : "Find: ");
+        return;
+    }
+
+    // Ctrl+G (or Cmd+G) goes to the next match, and with Shift the previous
+    if (key == GLFW_KEY_G && (action == GLFW_PRESS || action == GLFW_REPEAT) && (mods & (GLFW_MOD_CONTROL | GLFW_MOD_SUPER))) {
+        if (mods & GLFW_MOD_SHIFT) {
+            this->show_match(search.prev_match(text_layer.get_start_line()));
+        } else {
+            this->show_match(search.next_match(text_layer.get_start_line()));
+        }
+        return;
+    }
+
+    if (this->entering_query && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+        if (key == GLFW_KEY_ENTER) {
+            // The search for what's been typed is already underway
+            this->entering_query = false;
+            return;
+        } else if (key == GLFW_KEY_BACKSPACE && !this->query.empty()) {
+            // Drop the whole of the last codepoint, not just its last byte
+            while ((this->query.back() & 0xC0) == 0x80) {
+                this->query.pop_back();
+            }
+
+            this->query.pop_back();
+            this->start_search();
+            return;
+        }
+    }
+
+    // The line count is only an estimate while the buffer is still being indexed
     if (key == GLFW_KEY_DOWN && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
-        text_layer.set_start_line(text_layer.get_start_line() + 1);
-        this->add_outgoing_event({LayerUpdateRequest, {}});
+        if (text_layer.get_start_line() + 1 < buffer.line_count()) {
+            text_layer.set_start_line(text_layer.get_start_line() + 1);
+            this->add_outgoing_event({LayerUpdateRequest, {}});
+        }
     } else if (key == GLFW_KEY_UP && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
-        text_layer.set_start_line(text_layer.get_start_line() - 1);
+        if (text_layer.get_start_line() > 0) {
+            text_layer.set_start_line(text_layer.get_start_line() - 1);
+            this->add_outgoing_event({LayerUpdateRequest, {}});
+        }
+    }
+}
+
+void Engine::handle_char_event(unsigned int codepoint) {
+    if (!this->entering_query) {
+        return;
+    }
+
+    encode_utf8(codepoint, this->query);
+    this->start_search();
+}
+
+void Engine::start_search() {
+    // Starting over cancels whatever search is already running, which with
+    // an empty query just leaves no matches at all
+    text_layer.refresh_lines();
+    this->add_outgoing_event({LayerUpdateRequest, {}});
+
+    if (this->query.empty()) {
+        search.start(buffer.snapshot(), "");
+        return;
+    }
+
+    // Search from the top of the viewport, unless it's somehow past the end
+    // of the document
+    size_t line = text_layer.get_start_line();
+    std::optional<size_t> offset = buffer.line_offset(line);
+
+    if (!offset.has_value()) {
+        line = 0;
+        offset = 0;
+    }
+
+    PLOGI << "Searching for \"" << this->query << "\"";
+    search.start(buffer.snapshot(), this->query, this->query_mode, *offset, line, text_layer.get_rows());
+}
+
+void Engine::show_match(std::optional<SearchMatch> match) {
+    if (!match.has_value()) {
+        return;
+    }
+
+    text_layer.set_start_line(match->line);
+    this->add_outgoing_event({LayerUpdateRequest, {}});
+}
+
+void Engine::handle_follow() {
+    if (!buffer.is_following()) {
+        return;
+    }
+
+    // Stick to the bottom if that's where we were before the file grew
+    bool pinned = text_layer.get_start_line() + text_layer.get_rows() >= buffer.line_count();
+
+    if (buffer.poll_follow() > 0 && pinned) {
+        size_t line_count = buffer.line_count();
+        size_t rows = text_layer.get_rows();
+
+        text_layer.set_start_line(line_count > rows ? line_count - rows : 0);
         this->add_outgoing_event({LayerUpdateRequest, {}});
     }
 }
@@ -81,6 +284,10 @@ void Engine::process_events() {
     // 1. Process incoming events from the window
     // 2. Send outgoing events to the window
 
+    // Anything appended to a followed file is picked up once per frame,
+    // however many times it was written to in the meantime
+    this->handle_follow();
+
     std::optional<Event> event;
     while ((event = this->pop_incoming_event()).has_value()) {
         switch (event->type) {
@@ -97,12 +304,65 @@ void Engine::process_events() {
                 std::get<int>(event->data[3])
             );
             break;
+        case Char:
+            this->handle_char_event(std::get<int>(event->data[0]));
+            break;
         case CursorPosition:
             text_layer.set_position(
                 std::get<double>(event->data[0]),
                 std::get<double>(event->data[1])
             );
             break;
+        case BufferIndexProgress:
+            // Pull whatever the indexer has found into the buffer
+            buffer.sync_index();
+
+            if (buffer.is_indexing()) {
+                PLOGD << "Indexed " << 100.0f * std::get<float>(event->data[0]) << "% of buffer";
+            } else {
+                PLOGI << "Finished indexing buffer, " << buffer.line_count() << " lines";
+            }
+            break;
+        case BufferSaveProgress:
+            PLOGD << "Saved " << 100.0f * std::get<float>(event->data[0]) << "% of buffer";
+            break;
+        case BufferSaveComplete:
+            if (std::get<int>(event->data[0])) {
+                PLOGI << "Finished saving buffer";
+            } else {
+                PLOGE << "Failed to save buffer";
+            }
+            break;
+        case BufferDecompressProgress:
+            // What's been decompressed so far can be scrolled through while
+            // the rest is on its way
+            buffer.sync_decompressed();
+            PLOGD << "Decompressed " << 100.0f * std::get<float>(event->data[0]) << "% of buffer";
+            break;
+        case BufferDecompressComplete:
+            // Swap the whole file in for the start we've been showing
+            if (buffer.finish_decompressing()) {
+                PLOGI << "Finished decompressing buffer";
+                this->add_outgoing_event({LayerUpdateRequest, {}});
+            }
+            break;
+        case BufferSearchProgress:
+            PLOGD << "Searched " << 100.0f * std::get<float>(event->data[0]) << "% of buffer";
+
+            // Matches might have turned up on screen since last time
+            text_layer.refresh_lines();
+            this->add_outgoing_event({LayerUpdateRequest, {}});
+            break;
+        case BufferSearchMatch:
+            // Show the nearest match as soon as there is one
+            text_layer.refresh_lines();
+            this->show_match(search.nearest_match());
+            break;
+        case BufferSearchComplete:
+            PLOGD << "Finished searching for \"" << search.get_needle() << "\"";
+            text_layer.refresh_lines();
+            this->add_outgoing_event({LayerUpdateRequest, {}});
+            break;
         default:
             PLOGE << "Got unknown event type";
             break;
@@ -111,6 +371,8 @@ void Engine::process_events() {
 }
 
 std::optional<Event> Engine::pop_incoming_event() {
+    std::lock_guard<std::mutex> lock(this->incoming_event_mutex);
+
     if (this->incoming_event_queue.empty())
         return {};
 
@@ -133,5 +395,6 @@ std::optional<Event> Engine::pop_outgoing_event() {
 }
 
 void Engine::add_incoming_event(Event event) {
+    std::lock_guard<std::mutex> lock(this->incoming_event_mutex);
     this->incoming_event_queue.push(event);
 }
@@ -0,0 +1,181 @@
+#include "vigor/global.h"
+#include "vigor/file_watcher.h"
+
+#include <filesystem>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+FileWatcher::~FileWatcher() {
+    this->stop();
+}
+
+bool FileWatcher::is_watching() {
+    return this->watching;
+}
+
+FileWatcher::Identity FileWatcher::identify(const std::string &filepath) {
+#ifdef _WIN32
+    // The file index only comes from an open handle, but asking for no
+    // access at all doesn't get in the way of whoever's writing to it
+    HANDLE handle = CreateFileA(
+        filepath.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (handle == INVALID_HANDLE_VALUE) {
+        return {0, 0};
+    }
+
+    BY_HANDLE_FILE_INFORMATION info;
+    bool success = GetFileInformationByHandle(handle, &info);
+    CloseHandle(handle);
+
+    if (!success) {
+        return {0, 0};
+    }
+
+    return {info.dwVolumeSerialNumber, (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow};
+#else
+    struct stat info;
+
+    if (stat(filepath.c_str(), &info) != 0) {
+        return {0, 0};
+    }
+
+    return {uint64_t(info.st_dev), uint64_t(info.st_ino)};
+#endif
+}
+
+#ifdef __linux__
+
+void FileWatcher::add_watch() {
+    // Watches follow the inode rather than the path, so this has to be
+    // redone whenever the file is replaced (rotated, saved over, etc.)
+    this->watch_fd = inotify_add_watch(
+        this->inotify_fd,
+        this->filepath.c_str(),
+        IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+}
+
+bool FileWatcher::watch(const std::string &filepath) {
+    this->stop();
+
+    this->filepath = filepath;
+    this->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (this->inotify_fd < 0) {
+        PLOGE << "Failed to initialize inotify";
+        return false;
+    }
+
+    this->add_watch();
+
+    if (this->watch_fd < 0) {
+        PLOGE << "Failed to watch " << filepath;
+        this->stop();
+        return false;
+    }
+
+    this->watching = true;
+    return true;
+}
+
+void FileWatcher::stop() {
+    if (this->inotify_fd >= 0) {
+        close(this->inotify_fd);
+    }
+
+    this->inotify_fd = -1;
+    this->watch_fd = -1;
+    this->watching = false;
+}
+
+bool FileWatcher::poll() {
+    if (!this->watching) {
+        return false;
+    }
+
+    // However many events piled up since last time, they all boil down to
+    // one check of the file
+    alignas(inotify_event) char events[4096];
+    bool changed = false;
+    bool replaced = false;
+    ssize_t len;
+
+    while ((len = read(this->inotify_fd, events, sizeof(events))) > 0) {
+        for (char *cursor = events; cursor < events + len;) {
+            const inotify_event *event = reinterpret_cast<const inotify_event*>(cursor);
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                replaced = true;
+            }
+
+            changed = true;
+            cursor += sizeof(inotify_event) + event->len;
+        }
+    }
+
+    if (replaced || this->watch_fd < 0) {
+        if (this->watch_fd >= 0) {
+            inotify_rm_watch(this->inotify_fd, this->watch_fd);
+        }
+
+        // The new file might not be there yet, in which case we just try
+        // again next time
+        this->add_watch();
+        changed = true;
+    }
+
+    return changed;
+}
+
+#else
+
+bool FileWatcher::watch(const std::string &filepath) {
+    std::error_code err;
+
+    this->filepath = filepath;
+    this->last_size = std::filesystem::file_size(filepath, err);
+
+    if (err) {
+        PLOGE << "Failed to watch " << filepath;
+        return false;
+    }
+
+    this->watching = true;
+    return true;
+}
+
+void FileWatcher::stop() {
+    this->watching = false;
+}
+
+bool FileWatcher::poll() {
+    if (!this->watching) {
+        return false;
+    }
+
+    // A single stat per poll is cheap enough to not bother with the native
+    // notification APIs
+    std::error_code err;
+    uint64_t size = std::filesystem::file_size(this->filepath, err);
+
+    if (err || size == this->last_size) {
+        return false;
+    }
+
+    this->last_size = size;
+    return true;
+}
+
+#endif
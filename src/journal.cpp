@@ -0,0 +1,406 @@
+#include "vigor/global.h"
+#include "vigor/journal.h"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Journals are only ever read back on the machine that wrote them, so
+// everything is stored in native byte order.
+//
+// Header: magic, base size, base mtime, crc of the previous 20 bytes
+// Record: crc of the body, body length, then the body itself, which is
+// type, offset, count and (for inserts) the inserted text
+static const char journal_magic[4] = {'V', 'G', 'J', '1'};
+static const size_t record_header_size = 4 + 4;
+static const size_t record_body_size = 1 + 8 + 8;
+
+static std::array<uint32_t, 256> make_crc_table() {
+    std::array<uint32_t, 256> table;
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320 : 0);
+        }
+
+        table[i] = crc;
+    }
+
+    return table;
+}
+
+static uint32_t crc32(const char *data, size_t len) {
+    static const std::array<uint32_t, 256> table = make_crc_table();
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ uint8_t(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+template <typename T>
+static void put(std::string &out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static T get(const char *data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+static std::string make_header(Journal::Base base) {
+    std::string out(journal_magic, sizeof(journal_magic));
+    put<uint64_t>(out, base.size);
+    put<int64_t>(out, base.mtime);
+    put<uint32_t>(out, crc32(out.data(), out.size()));
+    return out;
+}
+
+static void make_record(std::string &out, const Journal::Record &record) {
+    std::string_view text = record.type == Journal::Insert ? record.text : std::string_view();
+    size_t start = out.size();
+
+    put<uint32_t>(out, 0);
+    put<uint32_t>(out, record_body_size + text.size());
+    put<uint8_t>(out, record.type);
+    put<uint64_t>(out, record.offset);
+    put<uint64_t>(out, record.count);
+    out.append(text);
+
+    uint32_t crc = crc32(out.data() + start + record_header_size, out.size() - start - record_header_size);
+    memcpy(out.data() + start, &crc, sizeof(crc));
+}
+
+static bool sync_file(std::FILE *file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+Journal::~Journal() {
+    this->close(false);
+}
+
+Journal::Base Journal::file_base(const std::string &filepath) {
+    std::error_code err;
+    uint64_t size = std::filesystem::file_size(filepath, err);
+
+    if (err) {
+        return {0, 0};
+    }
+
+    std::filesystem::file_time_type mtime = std::filesystem::last_write_time(filepath, err);
+
+    if (err) {
+        return {0, 0};
+    }
+
+    return {size, int64_t(mtime.time_since_epoch().count())};
+}
+
+size_t Journal::open(std::string path, Base base, replay_callable_t replay) {
+    this->close(false);
+
+    this->path = path;
+    this->base = base;
+
+    std::string contents;
+    {
+        std::ifstream existing(path, std::ios::binary);
+
+        if (existing.is_open()) {
+            contents.assign(std::istreambuf_iterator<char>(existing), std::istreambuf_iterator<char>());
+        }
+    }
+
+    std::string header = make_header(base);
+    size_t replayed = 0;
+    size_t good_size = 0;
+
+    if (contents.compare(0, header.size(), header) == 0) {
+        good_size = header.size();
+
+        // Replay records up until the first one that's cut off or doesn't
+        // match its checksum, which is wherever we were when we crashed
+        while (contents.size() - good_size >= record_header_size) {
+            const char *data = contents.data() + good_size;
+            uint32_t crc = get<uint32_t>(data);
+            uint32_t length = get<uint32_t>(data + 4);
+
+            if (length < record_body_size || contents.size() - good_size - record_header_size < length) {
+                break;
+            }
+
+            const char *body = data + record_header_size;
+
+            if (crc32(body, length) != crc) {
+                break;
+            }
+
+            Record record = {
+                RecordType(get<uint8_t>(body)),
+                get<uint64_t>(body + 1),
+                get<uint64_t>(body + 9),
+                std::string_view(body + record_body_size, length - record_body_size),
+            };
+
+            if (record.type != Insert && record.type != Erase) {
+                break;
+            }
+
+            if (replay) {
+                replay(record);
+            }
+
+            replayed++;
+            good_size += record_header_size + length;
+        }
+
+        if (good_size < contents.size()) {
+            PLOGW << "Dropping " << contents.size() - good_size << " bytes of damaged journal from " << path;
+        }
+    } else if (!contents.empty()) {
+        PLOGW << "Discarding journal " << path << ", it doesn't match the file";
+    }
+
+    if (good_size > 0) {
+        std::error_code err;
+        std::filesystem::resize_file(path, good_size, err);
+        this->file = err ? nullptr : std::fopen(path.c_str(), "ab");
+    } else {
+        this->file = std::fopen(path.c_str(), "wb");
+
+        if (this->file) {
+            std::fwrite(header.data(), 1, header.size(), this->file);
+            std::fflush(this->file);
+            good_size = header.size();
+        }
+    }
+
+    if (!this->file) {
+        PLOGE << "Failed to open journal " << path;
+        return replayed;
+    }
+
+    this->journal_size = good_size;
+    this->compacted_size = good_size;
+
+    if (replayed > 0) {
+        PLOGI << "Replayed " << replayed << " edits from " << path;
+    }
+
+    return replayed;
+}
+
+void Journal::close(bool discard) {
+    this->wait_for_compaction();
+
+    if (this->file) {
+        std::fclose(this->file);
+        this->file = nullptr;
+
+        if (discard) {
+            std::remove(this->path.c_str());
+        }
+    }
+}
+
+bool Journal::is_open() {
+    return this->file != nullptr;
+}
+
+void Journal::write_record(const Record &record) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (!this->file) {
+        return;
+    }
+
+    std::string out;
+    make_record(out, record);
+
+    // Flushing hands the record to the OS, which is enough to survive us
+    // crashing. Syncing on every keystroke would cost far more than the
+    // edit itself.
+    std::fwrite(out.data(), 1, out.size(), this->file);
+    std::fflush(this->file);
+    this->journal_size += out.size();
+    this->written += out.size();
+
+    if (this->rebasing > 0) {
+        this->pending.append(out);
+    }
+}
+
+void Journal::record_insert(size_t offset, std::string_view text) {
+    this->write_record({Insert, offset, text.size(), text});
+}
+
+void Journal::record_erase(size_t offset, size_t count) {
+    this->write_record({Erase, offset, count, {}});
+}
+
+Journal::Rebase Journal::start_rebase() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (this->rebasing++ == 0) {
+        this->pending.clear();
+        this->pending_mark = this->written;
+    }
+
+    return {++this->last_rebase, this->written};
+}
+
+void Journal::end_rebase() {
+    // Once nothing's rebasing, nothing needs the pending records either
+    if (--this->rebasing == 0) {
+        this->pending.clear();
+        this->pending_mark = this->written;
+    }
+}
+
+void Journal::cancel_rebase(Rebase) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->end_rebase();
+}
+
+bool Journal::finish_rebase(Rebase rebase, Base base, const std::vector<Record> &records) {
+    // A save that started during a compaction waits its turn here, on its
+    // own thread rather than whoever started it
+    std::lock_guard<std::mutex> rebase_lock(this->rebase_mutex);
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        if (rebase.id < this->newest_rebase) {
+            PLOGD << "Dropping rebase of " << this->path << ", a newer one already finished";
+            this->end_rebase();
+            return false;
+        }
+    }
+
+    std::string temp_path = this->path + ".tmp";
+    std::FILE *temp = std::fopen(temp_path.c_str(), "wb");
+
+    if (!temp) {
+        PLOGE << "Failed to rewrite journal " << this->path;
+        this->cancel_rebase(rebase);
+        return false;
+    }
+
+    // The bulk of the new journal is written without holding the lock, so
+    // edits can keep being journaled in the meantime
+    std::string out = make_header(base);
+    bool success = true;
+
+    for (const Record &record : records) {
+        make_record(out, record);
+
+        if (out.size() >= compact_threshold) {
+            success = std::fwrite(out.data(), 1, out.size(), temp) == out.size() && success;
+            out.clear();
+        }
+    }
+
+    success = std::fwrite(out.data(), 1, out.size(), temp) == out.size() && success;
+    size_t size = std::ftell(temp);
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    // Then whatever got journaled since the snapshot goes on the end
+    std::string_view since = std::string_view(this->pending).substr(rebase.mark - this->pending_mark);
+    success = std::fwrite(since.data(), 1, since.size(), temp) == since.size() && success;
+    size += since.size();
+    success = sync_file(temp) && success;
+    std::fclose(temp);
+
+    this->newest_rebase = rebase.id;
+    this->end_rebase();
+
+    if (this->file) {
+        std::fclose(this->file);
+        this->file = nullptr;
+    }
+
+    std::error_code err;
+
+    if (success) {
+        std::filesystem::rename(temp_path, this->path, err);
+    }
+
+    if (!success || err) {
+        // The old journal still has everything in it, it just isn't
+        // relative to the new base
+        PLOGE << "Failed to rewrite journal " << this->path;
+        std::remove(temp_path.c_str());
+        this->file = std::fopen(this->path.c_str(), "ab");
+        return false;
+    }
+
+    this->file = std::fopen(this->path.c_str(), "ab");
+    this->base = base;
+    this->journal_size = size;
+    this->compacted_size = size;
+
+    PLOGD << "Rewrote journal " << this->path << " (" << size << " bytes)";
+
+    return true;
+}
+
+bool Journal::should_compact() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    // Compacting only pays off if the journal has grown a fair bit since
+    // last time, otherwise large documents would be compacted constantly
+    return this->file && this->rebasing == 0
+        && this->journal_size > compact_threshold
+        && this->journal_size > 2 * this->compacted_size;
+}
+
+bool Journal::is_rebasing() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->rebasing > 0;
+}
+
+void Journal::rebase(Base base, std::vector<Record> records) {
+    this->wait_for_compaction();
+    Rebase rebase = this->start_rebase();
+
+    this->compact_thread = std::thread([this, rebase, base, records = std::move(records)]() {
+        this->finish_rebase(rebase, base, records);
+    });
+}
+
+void Journal::compact(std::vector<Record> records) {
+    this->rebase(this->base, std::move(records));
+}
+
+void Journal::wait_for_compaction() {
+    if (this->compact_thread.joinable()) {
+        this->compact_thread.join();
+    }
+}
@@ -0,0 +1,319 @@
+#include "vigor/line_index.h"
+#include "vigor/line_scanner.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Where sparse mode starts out placing checkpoints, before any thinning
+static const size_t initial_checkpoint_lines = 1024;
+static const size_t initial_checkpoint_bytes = 256 << 10;
+
+void LineIndex::use_dense() {
+    this->mode = Dense;
+    this->data = nullptr;
+    this->data_size = 0;
+    this->clear();
+    this->checkpoints.shrink_to_fit();
+}
+
+void LineIndex::use_sparse(const char *data, size_t data_size, size_t memory_cap) {
+    this->mode = Sparse;
+    this->data = data;
+    this->data_size = data_size;
+    this->max_checkpoints = std::max<size_t>(memory_cap / sizeof(Checkpoint), 2);
+    this->clear();
+
+    // The checkpoints never grow past this, so they never reallocate either
+    this->checkpoints.shrink_to_fit();
+    this->checkpoints.reserve(this->max_checkpoints);
+}
+
+void LineIndex::set_data(const char *data, size_t data_size) {
+    this->data = data;
+    this->data_size = data_size;
+}
+
+LineIndex::Mode LineIndex::get_mode() const {
+    return this->mode;
+}
+
+void LineIndex::clear() {
+    this->blocks.clear();
+    this->words.clear();
+    this->tail.clear();
+
+    this->entry_count = 0;
+    this->checkpoints.clear();
+    this->checkpoint_lines = initial_checkpoint_lines;
+    this->checkpoint_bytes = initial_checkpoint_bytes;
+}
+
+void LineIndex::push_back(uint64_t offset) {
+    if (this->mode == Sparse) {
+        const Checkpoint *last = this->checkpoints.empty() ? nullptr : &this->checkpoints.back();
+
+        if (!last
+            || this->entry_count - last->line >= this->checkpoint_lines
+            || offset - last->offset >= this->checkpoint_bytes) {
+            this->add_checkpoint(this->entry_count, offset);
+        }
+
+        this->entry_count++;
+        return;
+    }
+
+    this->tail.push_back(offset);
+
+    if (this->tail.size() == block_size) {
+        this->seal_tail();
+    }
+}
+
+void LineIndex::append(const uint64_t *offsets, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        this->push_back(offsets[i]);
+    }
+}
+
+void LineIndex::scan(uint64_t start, uint64_t stop) {
+    uint64_t offset = start;
+
+    while (offset < stop) {
+        // Up until `byte_limit`, the only way a line start can get a
+        // checkpoint is by being `checkpoint_lines` past the last one, so
+        // the data is searched for that newline in one go
+        uint64_t byte_limit = offset;
+
+        if (!this->checkpoints.empty()) {
+            const Checkpoint &last = this->checkpoints.back();
+            uint64_t lines_left = std::max<uint64_t>(last.line + this->checkpoint_lines + 1 - this->entry_count, 1);
+            const char *cursor = this->data + offset;
+
+            byte_limit = std::clamp<uint64_t>(last.offset + this->checkpoint_bytes - 1, offset, stop);
+
+            const char *newline = find_nth_newline(cursor, byte_limit - offset, lines_left);
+
+            if (newline) {
+                this->entry_count += lines_left - 1;
+                offset = newline - this->data + 1;
+                this->push_back(offset);
+                continue;
+            }
+
+            this->entry_count += count_newlines(cursor, byte_limit - offset);
+        }
+
+        // From there on, the very next line start is far enough along
+        const char *newline = static_cast<const char*>(memchr(this->data + byte_limit, '\n', stop - byte_limit));
+
+        if (!newline) {
+            break;
+        }
+
+        offset = newline - this->data + 1;
+        this->push_back(offset);
+    }
+}
+
+void LineIndex::shrink_to_fit() {
+    this->blocks.shrink_to_fit();
+    this->words.shrink_to_fit();
+    this->checkpoints.shrink_to_fit();
+}
+
+void LineIndex::add_checkpoint(uint64_t line, uint64_t offset) {
+    // Thinning happens before there's a checkpoint too many rather than
+    // after, so the reserved space is all that's ever used
+    if (this->checkpoints.size() == this->max_checkpoints) {
+        this->thin_checkpoints();
+
+        // This one might not be far enough along anymore
+        const Checkpoint &last = this->checkpoints.back();
+
+        if (line - last.line < this->checkpoint_lines && offset - last.offset < this->checkpoint_bytes) {
+            return;
+        }
+    }
+
+    this->checkpoints.push_back({line, offset});
+}
+
+void LineIndex::thin_checkpoints() {
+    // Keep every other checkpoint and space new ones out twice as far
+    size_t kept = 0;
+
+    for (size_t i = 0; i < this->checkpoints.size(); i += 2) {
+        this->checkpoints[kept++] = this->checkpoints[i];
+    }
+
+    this->checkpoints.resize(kept);
+    this->checkpoint_lines *= 2;
+    this->checkpoint_bytes *= 2;
+}
+
+const LineIndex::Checkpoint *LineIndex::checkpoint_for_line(uint64_t line) const {
+    auto next = std::upper_bound(
+        this->checkpoints.begin(),
+        this->checkpoints.end(),
+        line,
+        [](uint64_t value, const Checkpoint &checkpoint) { return value < checkpoint.line; });
+
+    return next == this->checkpoints.begin() ? nullptr : &*(next - 1);
+}
+
+const LineIndex::Checkpoint *LineIndex::checkpoint_for_offset(uint64_t offset) const {
+    auto next = std::upper_bound(
+        this->checkpoints.begin(),
+        this->checkpoints.end(),
+        offset,
+        [](uint64_t value, const Checkpoint &checkpoint) { return value < checkpoint.offset; });
+
+    return next == this->checkpoints.begin() ? nullptr : &*(next - 1);
+}
+
+void LineIndex::seal_tail() {
+    // Offsets are sorted, so the largest delta is the last one
+    uint64_t base = this->tail.front();
+    uint32_t width = std::bit_width(this->tail.back() - base);
+
+    Block block = {base, this->words.size(), width};
+    this->words.resize(this->words.size() + (block_size * width + 63) / 64, 0);
+
+    for (size_t i = 0; i < block_size; ++i) {
+        uint64_t delta = this->tail[i] - base;
+        size_t bit = i * width;
+        size_t word = block.word_offset + bit / 64;
+        size_t shift = bit % 64;
+
+        if (width == 0) {
+            continue;
+        }
+
+        this->words[word] |= delta << shift;
+
+        // The delta straddles two words
+        if (shift + width > 64) {
+            this->words[word + 1] |= delta >> (64 - shift);
+        }
+    }
+
+    this->blocks.push_back(block);
+    this->tail.clear();
+}
+
+uint64_t LineIndex::block_entry(const Block &block, size_t idx) const {
+    if (block.width == 0) {
+        return block.base;
+    }
+
+    size_t bit = idx * block.width;
+    size_t word = block.word_offset + bit / 64;
+    size_t shift = bit % 64;
+
+    uint64_t delta = this->words[word] >> shift;
+
+    if (shift + block.width > 64) {
+        delta |= this->words[word + 1] << (64 - shift);
+    }
+
+    if (block.width < 64) {
+        delta &= (uint64_t(1) << block.width) - 1;
+    }
+
+    return block.base + delta;
+}
+
+size_t LineIndex::size() const {
+    if (this->mode == Sparse) {
+        return this->entry_count;
+    }
+
+    return this->blocks.size() * block_size + this->tail.size();
+}
+
+uint64_t LineIndex::at(size_t idx) const {
+    if (this->mode == Sparse) {
+        // Scan forward from the closest checkpoint at or before the line
+        const Checkpoint *checkpoint = this->checkpoint_for_line(idx);
+
+        if (idx == checkpoint->line) {
+            return checkpoint->offset;
+        }
+
+        const char *newline = find_nth_newline(
+            this->data + checkpoint->offset,
+            this->data_size - checkpoint->offset,
+            idx - checkpoint->line);
+
+        return newline ? newline - this->data + 1 : this->data_size;
+    }
+
+    size_t block_idx = idx / block_size;
+
+    if (block_idx < this->blocks.size()) {
+        return this->block_entry(this->blocks[block_idx], idx % block_size);
+    }
+
+    return this->tail[idx - this->blocks.size() * block_size];
+}
+
+size_t LineIndex::upper_bound(uint64_t offset) const {
+    if (this->mode == Sparse) {
+        const Checkpoint *checkpoint = this->checkpoint_for_offset(offset);
+
+        if (!checkpoint) {
+            return 0;
+        }
+
+        // Every newline between the checkpoint and `offset` is one more line
+        // start at or before `offset`
+        size_t scan_length = std::min<uint64_t>(offset, this->data_size) - checkpoint->offset;
+        size_t count = checkpoint->line + 1 + count_newlines(this->data + checkpoint->offset, scan_length);
+
+        return std::min(count, this->entry_count);
+    }
+
+    size_t sealed = this->blocks.size() * block_size;
+
+    if (!this->tail.empty() && offset >= this->tail.front()) {
+        return sealed + (std::upper_bound(this->tail.begin(), this->tail.end(), offset) - this->tail.begin());
+    }
+
+    // Find the last block starting at or before `offset`...
+    auto next_block = std::upper_bound(
+        this->blocks.begin(),
+        this->blocks.end(),
+        offset,
+        [](uint64_t value, const Block &block) { return value < block.base; });
+
+    if (next_block == this->blocks.begin()) {
+        return 0;
+    }
+
+    // ...and then binary search inside of it
+    const Block &block = *(next_block - 1);
+    size_t low = 0;
+    size_t high = block_size;
+
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+
+        if (this->block_entry(block, mid) <= offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return (next_block - 1 - this->blocks.begin()) * block_size + low;
+}
+
+size_t LineIndex::memory_usage() const {
+    return this->blocks.capacity() * sizeof(Block)
+        + this->words.capacity() * sizeof(uint64_t)
+        + this->tail.capacity() * sizeof(uint64_t)
+        + this->checkpoints.capacity() * sizeof(Checkpoint);
+}
@@ -0,0 +1,347 @@
+#include "vigor/line_scanner.h"
+#include "vigor/simd.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// Chunks handed to worker threads are never smaller than this
+static const size_t min_chunk_size = 4 << 20;
+
+// Portable versions, used for the tail end of every scan as well as on
+// platforms where we don't have anything better. `memchr` is already
+// vectorized by every libc worth using.
+
+static size_t count_newlines_scalar(const char *data, size_t length) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        count += data[i] == '\n';
+    }
+
+    return count;
+}
+
+static const char *find_last_newline_scalar(const char *data, size_t length) {
+    while (length > 0) {
+        if (data[--length] == '\n') {
+            return data + length;
+        }
+    }
+
+    return nullptr;
+}
+
+// The `write_line_starts_*` functions write into `out`, which must already
+// have room for every line start, and return how many were written.
+
+static size_t write_line_starts_scalar(const char *data, size_t length, size_t base, uint64_t *out) {
+    const char *end = data + length;
+    const char *cursor = data;
+    size_t count = 0;
+
+    while (cursor < end) {
+        const char *newline = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+
+        if (!newline) {
+            break;
+        }
+
+        out[count++] = base + (newline - data) + 1;
+        cursor = newline + 1;
+    }
+
+    return count;
+}
+
+#ifdef VIGOR_X86
+
+static size_t count_newlines_sse2(const char *data, size_t length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t i = 0;
+
+    // Matches are accumulated per byte lane (a compare yields -1, so we
+    // subtract), and flushed with a sum of absolute differences before any
+    // lane can overflow.
+    while (i + 16 <= length) {
+        __m128i acc = _mm_setzero_si128();
+        size_t block_end = i + 255 * 16;
+
+        for (; i + 16 <= length && i < block_end; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(chunk, newline));
+        }
+
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+    }
+
+    return count + count_newlines_scalar(data + i, length - i);
+}
+
+VIGOR_TARGET_AVX2
+static size_t count_newlines_avx2(const char *data, size_t length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 32 <= length) {
+        __m256i acc = _mm256_setzero_si256();
+        size_t block_end = i + 255 * 32;
+
+        for (; i + 32 <= length && i < block_end; i += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(chunk, newline));
+        }
+
+        __m256i sums = _mm256_sad_epu8(acc, zero);
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1)
+            + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+
+    return count + count_newlines_scalar(data + i, length - i);
+}
+
+// The backwards scans walk blocks from the end, so the highest set bit
+// of the first non-zero mask is the newline we're after
+
+static const char *find_last_newline_sse2(const char *data, size_t length) {
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    while (length >= 16) {
+        length -= 16;
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + length));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        if (mask) {
+            return data + length + 31 - VIGOR_CLZ(mask);
+        }
+    }
+
+    return find_last_newline_scalar(data, length);
+}
+
+VIGOR_TARGET_AVX2
+static const char *find_last_newline_avx2(const char *data, size_t length) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    while (length >= 32) {
+        length -= 32;
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + length));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+
+        if (mask) {
+            return data + length + 31 - VIGOR_CLZ(mask);
+        }
+    }
+
+    return find_last_newline_scalar(data, length);
+}
+
+static size_t write_line_starts_sse2(const char *data, size_t length, size_t base, uint64_t *out) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        while (mask) {
+            out[count++] = base + i + VIGOR_CTZ(mask) + 1;
+            mask &= mask - 1;
+        }
+    }
+
+    return count + write_line_starts_scalar(data + i, length - i, base + i, out + count);
+}
+
+VIGOR_TARGET_AVX2
+static size_t write_line_starts_avx2(const char *data, size_t length, size_t base, uint64_t *out) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+
+        while (mask) {
+            out[count++] = base + i + VIGOR_CTZ(mask) + 1;
+            mask &= mask - 1;
+        }
+    }
+
+    return count + write_line_starts_scalar(data + i, length - i, base + i, out + count);
+}
+
+#endif
+
+static ScanPath best_scan_path() {
+#ifdef VIGOR_X86
+    return has_avx2 ? AVX2Scan : SSE2Scan;
+#else
+    return ScalarScan;
+#endif
+}
+
+static ScanPath scan_path = best_scan_path();
+
+void set_scan_path(ScanPath path) {
+    scan_path = std::min(path, best_scan_path());
+}
+
+ScanPath get_scan_path() {
+    return scan_path;
+}
+
+size_t count_newlines(const char *data, size_t length) {
+#ifdef VIGOR_X86
+    if (scan_path == AVX2Scan) {
+        return count_newlines_avx2(data, length);
+    } else if (scan_path == SSE2Scan) {
+        return count_newlines_sse2(data, length);
+    }
+#endif
+
+    return count_newlines_scalar(data, length);
+}
+
+const char *find_last_newline(const char *data, size_t length) {
+#ifdef VIGOR_X86
+    if (scan_path == AVX2Scan) {
+        return find_last_newline_avx2(data, length);
+    } else if (scan_path == SSE2Scan) {
+        return find_last_newline_sse2(data, length);
+    }
+#endif
+
+    return find_last_newline_scalar(data, length);
+}
+
+const char *find_nth_newline(const char *data, size_t length, size_t n) {
+    if (n == 0) {
+        return nullptr;
+    }
+
+    // Skip over whole blocks using the vectorized count, then find the
+    // exact newline inside the block where it lives
+    const size_t block_size = 4096;
+    size_t offset = 0;
+
+    while (length - offset > block_size) {
+        size_t count = count_newlines(data + offset, block_size);
+
+        if (count >= n) {
+            break;
+        }
+
+        n -= count;
+        offset += block_size;
+    }
+
+    const char *end = data + length;
+    const char *cursor = data + offset;
+
+    while (cursor < end) {
+        const char *newline = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+
+        if (!newline || --n == 0) {
+            return newline;
+        }
+
+        cursor = newline + 1;
+    }
+
+    return nullptr;
+}
+
+static size_t write_line_starts(const char *data, size_t length, size_t base, uint64_t *out) {
+#ifdef VIGOR_X86
+    if (scan_path == AVX2Scan) {
+        return write_line_starts_avx2(data, length, base, out);
+    } else if (scan_path == SSE2Scan) {
+        return write_line_starts_sse2(data, length, base, out);
+    }
+#endif
+
+    return write_line_starts_scalar(data, length, base, out);
+}
+
+void find_line_starts(const char *data, size_t length, size_t base, std::vector<uint64_t> &positions) {
+    // Counting first is cheap enough that it beats growing the vector as we go
+    size_t first = positions.size();
+    positions.resize(first + count_newlines(data, length));
+    write_line_starts(data, length, base, positions.data() + first);
+}
+
+void build_line_index(const char *data, size_t length, size_t base, std::vector<uint64_t> &positions, unsigned int threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Don't bother spinning up threads for chunks that would finish
+    // faster than the threads themselves can be started
+    size_t chunk_count = std::min<size_t>(threads, length / min_chunk_size);
+
+    if (chunk_count <= 1) {
+        find_line_starts(data, length, base, positions);
+        return;
+    }
+
+    size_t chunk_size = length / chunk_count;
+    std::vector<size_t> chunk_starts(chunk_count + 1);
+    std::vector<size_t> counts(chunk_count);
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        chunk_starts[i] = i * chunk_size;
+    }
+
+    chunk_starts[chunk_count] = length;
+
+    // Pass 1: Count the newlines in every chunk
+    for (size_t i = 0; i < chunk_count; ++i) {
+        workers.emplace_back([&, i]() {
+            counts[i] = count_newlines(data + chunk_starts[i], chunk_starts[i + 1] - chunk_starts[i]);
+        });
+    }
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    workers.clear();
+
+    // A prefix sum of the counts tells every chunk where its
+    // line starts go in the final index
+    std::vector<size_t> slots(chunk_count);
+    size_t total = positions.size();
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        slots[i] = total;
+        total += counts[i];
+    }
+
+    positions.resize(total);
+
+    // Pass 2: Every chunk writes its line starts into its own slot
+    for (size_t i = 0; i < chunk_count; ++i) {
+        workers.emplace_back([&, i]() {
+            write_line_starts(
+                data + chunk_starts[i],
+                chunk_starts[i + 1] - chunk_starts[i],
+                base + chunk_starts[i],
+                positions.data() + slots[i]);
+        });
+    }
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
@@ -0,0 +1,113 @@
+#include "vigor/line_scanner.h"
+#include "vigor/literal_scanner.h"
+#include "vigor/simd.h"
+
+#include <cstring>
+#include <string_view>
+
+// Every candidate's first and last bytes have already been matched by the
+// time these get called, so only the bytes in between are left to compare
+static bool matches_middle(const char *candidate, const char *needle, size_t length) {
+    return length <= 2 || memcmp(candidate + 1, needle + 1, length - 2) == 0;
+}
+
+static const char *find_literal_scalar(const char *data, size_t length, const char *needle, size_t needle_length) {
+    const char *end = data + length;
+    const char *cursor = data;
+
+    while (size_t(end - cursor) >= needle_length) {
+        cursor = static_cast<const char*>(memchr(cursor, needle[0], end - cursor - needle_length + 1));
+
+        if (!cursor) {
+            return nullptr;
+        }
+
+        if (cursor[needle_length - 1] == needle[needle_length - 1] && matches_middle(cursor, needle, needle_length)) {
+            return cursor;
+        }
+
+        cursor++;
+    }
+
+    return nullptr;
+}
+
+#ifdef VIGOR_X86
+
+static const char *find_literal_sse2(const char *data, size_t length, const char *needle, size_t needle_length) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_length - 1]);
+    size_t i = 0;
+
+    // Both loads have to stay inside of the data
+    for (; i + needle_length - 1 + 16 <= length; i += 16) {
+        __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + needle_length - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(block_first, first),
+            _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            const char *candidate = data + i + VIGOR_CTZ(mask);
+
+            if (matches_middle(candidate, needle, needle_length)) {
+                return candidate;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_literal_scalar(data + i, length - i, needle, needle_length);
+}
+
+VIGOR_TARGET_AVX2
+static const char *find_literal_avx2(const char *data, size_t length, const char *needle, size_t needle_length) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_length - 1]);
+    size_t i = 0;
+
+    for (; i + needle_length - 1 + 32 <= length; i += 32) {
+        __m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + needle_length - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_cmpeq_epi8(block_first, first),
+            _mm256_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            const char *candidate = data + i + VIGOR_CTZ(mask);
+
+            if (matches_middle(candidate, needle, needle_length)) {
+                return candidate;
+            }
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_literal_scalar(data + i, length - i, needle, needle_length);
+}
+
+#endif
+
+const char *find_literal(const char *data, size_t length, std::string_view needle) {
+    if (needle.empty() || needle.size() > length) {
+        return nullptr;
+    }
+
+    // A single byte is exactly what `memchr` is for
+    if (needle.size() == 1) {
+        return static_cast<const char*>(memchr(data, needle[0], length));
+    }
+
+    // Goes the same way as the newline scanners
+#ifdef VIGOR_X86
+    if (get_scan_path() == AVX2Scan) {
+        return find_literal_avx2(data, length, needle.data(), needle.size());
+    } else if (get_scan_path() == SSE2Scan) {
+        return find_literal_sse2(data, length, needle.data(), needle.size());
+    }
+#endif
+
+    return find_literal_scalar(data, length, needle.data(), needle.size());
+}
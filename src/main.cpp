@@ -27,5 +27,8 @@ int main(int argc, char **argv) {
     // Start the window's main loop
     window.main_loop();
 
+    // Stop any background work before things start getting destroyed
+    engine.teardown();
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,234 @@
+#include "vigor/global.h"
+#include "vigor/mapped_file.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile() {
+    this->close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &filepath) {
+    this->close();
+
+    HANDLE file = CreateFileA(
+        filepath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        PLOGE << "Failed to open " << filepath;
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        // Empty files can't be mapped
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping_handle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_handle) {
+        PLOGE << "Failed to create file mapping for " << filepath;
+        CloseHandle(file);
+        return false;
+    }
+
+    void *view = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        PLOGE << "Failed to map " << filepath;
+        CloseHandle(mapping_handle);
+        CloseHandle(file);
+        return false;
+    }
+
+    this->path = filepath;
+    this->delete_on_close = false;
+    this->file_handle = file;
+    this->mapping_handle = mapping_handle;
+    this->mapping = static_cast<const char*>(view);
+    this->mapping_size = static_cast<size_t>(file_size.QuadPart);
+
+    return true;
+}
+
+void MappedFile::close() {
+    if (this->mapping) {
+        UnmapViewOfFile(this->mapping);
+        CloseHandle(this->mapping_handle);
+        CloseHandle(this->file_handle);
+    }
+
+    if (this->delete_on_close) {
+        DeleteFileA(this->path.c_str());
+    }
+
+    this->mapping = nullptr;
+    this->mapping_size = 0;
+    this->file_handle = nullptr;
+    this->mapping_handle = nullptr;
+    this->path.clear();
+    this->delete_on_close = false;
+}
+
+void MappedFile::advise(size_t offset, size_t length, Advice advice) const {
+    if (!this->mapping || offset >= this->mapping_size) {
+        return;
+    }
+
+    // Windows only has an equivalent for prefetching
+    if (advice == WillNeed) {
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = const_cast<char*>(this->mapping + offset);
+        range.NumberOfBytes = std::min(length, this->mapping_size - offset);
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+}
+
+bool MappedFile::replace(const std::string &filepath, const std::string &replacement) {
+    std::error_code err;
+
+    if (!std::filesystem::exists(filepath, err)) {
+        std::filesystem::rename(replacement, filepath, err);
+        return !err;
+    }
+
+    bool mapped = this->mapping && std::filesystem::equivalent(this->path, filepath, err);
+
+    // The old file is renamed to the backup name rather than deleted, which
+    // is allowed while it's mapped since we opened it with FILE_SHARE_DELETE.
+    // The new one keeps its attributes and ACLs as well.
+    std::string aside = filepath + "." + std::to_string(GetTickCount64()) + ".old";
+
+    if (!ReplaceFileA(filepath.c_str(), replacement.c_str(), aside.c_str(), REPLACEFILE_IGNORE_MERGE_ERRORS, nullptr, nullptr)) {
+        PLOGE << "Failed to replace " << filepath << " (error " << GetLastError() << ")";
+        return false;
+    }
+
+    if (mapped) {
+        this->path = aside;
+        this->delete_on_close = true;
+    } else {
+        DeleteFileA(aside.c_str());
+    }
+
+    return true;
+}
+
+#else
+
+bool MappedFile::open(const std::string &filepath) {
+    this->close();
+
+    int fd = ::open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        PLOGE << "Failed to open " << filepath;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        // Empty files and anything that isn't a regular file can't be mapped
+        ::close(fd);
+        return false;
+    }
+
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        PLOGE << "Failed to map " << filepath;
+        ::close(fd);
+        return false;
+    }
+
+    this->fd = fd;
+    this->mapping = static_cast<const char*>(addr);
+    this->mapping_size = st.st_size;
+
+    return true;
+}
+
+void MappedFile::close() {
+    if (this->mapping) {
+        munmap(const_cast<char*>(this->mapping), this->mapping_size);
+    }
+
+    if (this->fd >= 0) {
+        ::close(this->fd);
+    }
+
+    this->mapping = nullptr;
+    this->mapping_size = 0;
+    this->fd = -1;
+}
+
+void MappedFile::advise(size_t offset, size_t length, Advice advice) const {
+    if (!this->mapping || offset >= this->mapping_size) {
+        return;
+    }
+
+    // madvise wants a page aligned address
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t aligned = offset - offset % page_size;
+    length = std::min(length, this->mapping_size - offset) + (offset - aligned);
+
+    int flag = MADV_NORMAL;
+
+    switch (advice) {
+    case Sequential:
+        flag = MADV_SEQUENTIAL;
+        break;
+    case Random:
+        flag = MADV_RANDOM;
+        break;
+    case WillNeed:
+        flag = MADV_WILLNEED;
+        break;
+    case DontNeed:
+        flag = MADV_DONTNEED;
+        break;
+    default:
+        break;
+    }
+
+    madvise(const_cast<char*>(this->mapping + aligned), length, flag);
+}
+
+bool MappedFile::replace(const std::string &filepath, const std::string &replacement) {
+    // The mapping holds on to the old file, whatever happens to its name
+    std::error_code err;
+    std::filesystem::rename(replacement, filepath, err);
+    return !err;
+}
+
+#endif
+
+const char *MappedFile::data() const {
+    return this->mapping;
+}
+
+size_t MappedFile::size() const {
+    return this->mapping_size;
+}
+
+bool MappedFile::is_open() const {
+    return this->mapping != nullptr;
+}
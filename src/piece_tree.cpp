@@ -0,0 +1,376 @@
+#include "vigor/piece_tree.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <vector>
+
+size_t PieceTree::Node::entries() const {
+    return this->leaf ? this->pieces.size() : this->children.size();
+}
+
+void PieceTree::Node::update() {
+    this->length = 0;
+    this->newlines = 0;
+    this->original_stop = 0;
+
+    if (this->leaf) {
+        for (const Piece &piece : this->pieces) {
+            this->length += piece.length;
+            this->newlines += piece.newlines;
+
+            if (piece.source == Original) {
+                this->original_stop = std::max(this->original_stop, piece.start + piece.length);
+            }
+        }
+
+        this->count = this->pieces.size();
+    } else {
+        this->count = 0;
+
+        for (const std::shared_ptr<Node> &child : this->children) {
+            this->length += child->length;
+            this->newlines += child->newlines;
+            this->count += child->count;
+            this->original_stop = std::max(this->original_stop, child->original_stop);
+        }
+    }
+}
+
+PieceTree::PieceTree() {
+    this->clear();
+}
+
+void PieceTree::clear() {
+    this->root = std::make_shared<Node>();
+}
+
+PieceTree::Node *PieceTree::own(std::shared_ptr<Node> &node) {
+    // Some other tree can still see this node, so it gets a copy of its own.
+    // The copy shares all of the same children, which is what makes every
+    // level below it shared in turn.
+    if (node.use_count() > 1) {
+        node = std::make_shared<Node>(*node);
+    } else {
+        // A snapshot let go of on another thread only drops the count with
+        // a release, so this makes sure it's done reading before we write
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    return node.get();
+}
+
+size_t PieceTree::length() const {
+    return this->root->length;
+}
+
+size_t PieceTree::newlines() const {
+    return this->root->newlines;
+}
+
+size_t PieceTree::count() const {
+    return this->root->count;
+}
+
+const Piece &PieceTree::at(size_t index) const {
+    const Node *node = this->root.get();
+
+    while (!node->leaf) {
+        for (const std::shared_ptr<Node> &child : node->children) {
+            if (index < child->count) {
+                node = child.get();
+                break;
+            }
+
+            index -= child->count;
+        }
+    }
+
+    return node->pieces[index];
+}
+
+PieceTree::Location PieceTree::find_offset(size_t offset) const {
+    // Anything past the end lands just after the last piece
+    if (offset >= this->root->length) {
+        return {this->root->count, 0, this->root->length, this->root->newlines};
+    }
+
+    Location loc = {0, 0, 0, 0};
+    const Node *node = this->root.get();
+
+    while (!node->leaf) {
+        for (const std::shared_ptr<Node> &child : node->children) {
+            if (offset < child->length) {
+                node = child.get();
+                break;
+            }
+
+            offset -= child->length;
+            loc.index += child->count;
+            loc.start += child->length;
+            loc.newlines_before += child->newlines;
+        }
+    }
+
+    for (const Piece &piece : node->pieces) {
+        if (offset < piece.length) {
+            loc.offset = offset;
+            break;
+        }
+
+        offset -= piece.length;
+        loc.index++;
+        loc.start += piece.length;
+        loc.newlines_before += piece.newlines;
+    }
+
+    return loc;
+}
+
+std::optional<PieceTree::Location> PieceTree::find_newline(size_t n) const {
+    if (n == 0 || n > this->root->newlines) {
+        return {};
+    }
+
+    Location loc = {0, 0, 0, 0};
+    const Node *node = this->root.get();
+
+    while (!node->leaf) {
+        for (const std::shared_ptr<Node> &child : node->children) {
+            if (n <= child->newlines) {
+                node = child.get();
+                break;
+            }
+
+            n -= child->newlines;
+            loc.index += child->count;
+            loc.start += child->length;
+            loc.newlines_before += child->newlines;
+        }
+    }
+
+    for (const Piece &piece : node->pieces) {
+        if (n <= piece.newlines) {
+            break;
+        }
+
+        n -= piece.newlines;
+        loc.index++;
+        loc.start += piece.length;
+        loc.newlines_before += piece.newlines;
+    }
+
+    return loc;
+}
+
+void PieceTree::insert(size_t index, const Piece &piece) {
+    std::shared_ptr<Node> sibling = this->insert(this->root, index, piece);
+
+    // The root itself split, so the tree grows by a level
+    if (sibling) {
+        auto new_root = std::make_shared<Node>();
+        new_root->leaf = false;
+        new_root->children.push_back(std::move(this->root));
+        new_root->children.push_back(std::move(sibling));
+        new_root->update();
+
+        this->root = std::move(new_root);
+    }
+}
+
+std::shared_ptr<PieceTree::Node> PieceTree::insert(std::shared_ptr<Node> &ptr, size_t index, const Piece &piece) {
+    Node *node = own(ptr);
+
+    if (node->leaf) {
+        node->pieces.insert(node->pieces.begin() + index, piece);
+    } else {
+        size_t i = 0;
+
+        // Inserting between two children goes at the end of the first one
+        for (; i + 1 < node->children.size(); ++i) {
+            if (index <= node->children[i]->count) {
+                break;
+            }
+
+            index -= node->children[i]->count;
+        }
+
+        std::shared_ptr<Node> split = this->insert(node->children[i], index, piece);
+
+        if (split) {
+            node->children.insert(node->children.begin() + i + 1, std::move(split));
+        }
+    }
+
+    if (node->entries() <= max_entries) {
+        node->update();
+        return nullptr;
+    }
+
+    // Too many entries, so the upper half moves to a new sibling
+    auto sibling = std::make_shared<Node>();
+    sibling->leaf = node->leaf;
+    size_t half = node->entries() / 2;
+
+    if (node->leaf) {
+        sibling->pieces.assign(node->pieces.begin() + half, node->pieces.end());
+        node->pieces.resize(half);
+    } else {
+        sibling->children.assign(
+            std::make_move_iterator(node->children.begin() + half),
+            std::make_move_iterator(node->children.end()));
+        node->children.resize(half);
+    }
+
+    node->update();
+    sibling->update();
+
+    return sibling;
+}
+
+void PieceTree::erase(size_t index) {
+    this->erase(this->root, index);
+
+    // The tree shrinks by a level once the root is down to one child. The
+    // root was just copied if it needed to be, so the child is ours to take.
+    if (!this->root->leaf && this->root->children.size() == 1) {
+        std::shared_ptr<Node> child = std::move(this->root->children[0]);
+        this->root = std::move(child);
+    }
+}
+
+void PieceTree::erase(std::shared_ptr<Node> &ptr, size_t index) {
+    Node *node = own(ptr);
+
+    if (node->leaf) {
+        node->pieces.erase(node->pieces.begin() + index);
+        node->update();
+        return;
+    }
+
+    size_t i = 0;
+
+    for (; i + 1 < node->children.size(); ++i) {
+        if (index < node->children[i]->count) {
+            break;
+        }
+
+        index -= node->children[i]->count;
+    }
+
+    this->erase(node->children[i], index);
+
+    if (node->children[i]->entries() < min_entries) {
+        this->rebalance(node, i);
+    }
+
+    node->update();
+}
+
+void PieceTree::rebalance(Node *node, size_t child_idx) {
+    if (node->children.size() < 2) {
+        return;
+    }
+
+    // Pair the underfull child up with a neighbour. Both are about to
+    // change, so neither can still be shared with another tree.
+    size_t left_idx = child_idx > 0 ? child_idx - 1 : child_idx;
+    Node *left = own(node->children[left_idx]);
+    Node *right = own(node->children[left_idx + 1]);
+
+    if (left->entries() + right->entries() <= max_entries) {
+        // Both fit in one node, so merge them
+        if (left->leaf) {
+            left->pieces.insert(left->pieces.end(), right->pieces.begin(), right->pieces.end());
+        } else {
+            left->children.insert(
+                left->children.end(),
+                std::make_move_iterator(right->children.begin()),
+                std::make_move_iterator(right->children.end()));
+        }
+
+        left->update();
+        node->children.erase(node->children.begin() + left_idx + 1);
+        return;
+    }
+
+    // Otherwise split the entries evenly between the two
+    size_t total = left->entries() + right->entries();
+    size_t left_count = total / 2;
+
+    if (left->leaf) {
+        std::vector<Piece> combined = std::move(left->pieces);
+        combined.insert(combined.end(), right->pieces.begin(), right->pieces.end());
+
+        left->pieces.assign(combined.begin(), combined.begin() + left_count);
+        right->pieces.assign(combined.begin() + left_count, combined.end());
+    } else {
+        std::vector<std::shared_ptr<Node>> combined = std::move(left->children);
+        combined.insert(
+            combined.end(),
+            std::make_move_iterator(right->children.begin()),
+            std::make_move_iterator(right->children.end()));
+
+        left->children.assign(
+            std::make_move_iterator(combined.begin()),
+            std::make_move_iterator(combined.begin() + left_count));
+        right->children.assign(
+            std::make_move_iterator(combined.begin() + left_count),
+            std::make_move_iterator(combined.end()));
+    }
+
+    left->update();
+    right->update();
+}
+
+void PieceTree::set(size_t index, const Piece &piece) {
+    this->set(this->root, index, piece);
+}
+
+void PieceTree::set(std::shared_ptr<Node> &ptr, size_t index, const Piece &piece) {
+    Node *node = own(ptr);
+
+    if (node->leaf) {
+        node->pieces[index] = piece;
+    } else {
+        for (std::shared_ptr<Node> &child : node->children) {
+            if (index < child->count) {
+                this->set(child, index, piece);
+                break;
+            }
+
+            index -= child->count;
+        }
+    }
+
+    node->update();
+}
+
+void PieceTree::transform_original(size_t past, const std::function<void(Piece&)> &fn) {
+    if (this->root->original_stop > past) {
+        this->transform_original(this->root, past, fn);
+    }
+}
+
+void PieceTree::transform_original(std::shared_ptr<Node> &ptr, size_t past, const std::function<void(Piece&)> &fn) {
+    Node *node = own(ptr);
+
+    if (node->leaf) {
+        for (Piece &piece : node->pieces) {
+            if (piece.source == Original && piece.start + piece.length > past) {
+                fn(piece);
+            }
+        }
+    } else {
+        for (std::shared_ptr<Node> &child : node->children) {
+            if (child->original_stop > past) {
+                this->transform_original(child, past, fn);
+            }
+        }
+    }
+
+    node->update();
+}
@@ -1,35 +1,1370 @@
 #include "vigor/global.h"
+#include "vigor/line_scanner.h"
 #include "vigor/text_buffer.h"
+#include "vigor/utf8.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
-#include <sstream>
+#include <iterator>
+#include <span>
 #include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The background indexer works through the original file in blocks this big,
+// publishing its progress after each one
+static const size_t index_block_size = 64 << 20;
+
+// Sparse indexes are built straight from the file under the lock, this much
+// at a time, so lookups on the main thread never wait long
+static const size_t sparse_index_step = 1 << 20;
+
+// Follow mode reads at most this much per poll, so a quickly growing file
+// can't hold up a frame for too long
+static const size_t follow_chunk_size = 64 << 20;
+
+// How much of a compressed file gets decompressed before `load_file` returns
+static const size_t decompress_head_size = 1 << 20;
+
+// The decompression thread reports its progress every time it writes this much
+static const size_t decompress_progress_size = 16 << 20;
+
+// The save thread reports its progress every time it writes this much
+static const size_t save_chunk_size = 16 << 20;
 
 TextBuffer::~TextBuffer() {
-    this->stream.flush();
-    this->stream.close();
+    this->stop_indexing();
+    this->stop_decompressing();
+    this->wait_for_save();
+    this->remove_decompressed();
+
+    // The journal is only worth keeping if it has edits that never made it
+    // to disk
+    this->journal.close(!this->is_modified());
+}
+
+void TextBuffer::register_change_callback(change_callable_t cb) {
+    this->change_callbacks.push_back(cb);
+}
+
+void TextBuffer::register_index_callback(index_callable_t cb) {
+    this->index_callback = cb;
+}
+
+void TextBuffer::register_save_callback(progress_callable_t cb) {
+    this->save_callback = cb;
+}
+
+void TextBuffer::register_decompress_callback(progress_callable_t cb) {
+    this->decompress_callback = cb;
+}
+
+void TextBuffer::register_reload_callback(reload_callable_t cb) {
+    this->reload_callback = cb;
+}
+
+void TextBuffer::load_file(std::string filepath) {
+    // The indexer and any pending save are reading the current mapping
+    this->stop_indexing();
+    this->stop_decompressing();
+    this->wait_for_save();
+    this->journal.close(!this->is_modified());
+    this->follow_watcher.stop();
+    this->remove_decompressed();
+
+    this->filepath = filepath;
+
+    // Snapshots of the last file hang on to its storage for as long as they
+    // need it, so this starts out fresh rather than reusing it
+    this->original_file = std::make_shared<MappedFile>();
+    this->original_copy = std::make_shared<std::string>();
+    this->compression = detect_compression(filepath);
+    this->read_only = false;
+
+    if (this->compression != Uncompressed) {
+        if (!this->decompress_head()) {
+            return;
+        }
+    } else if (this->original_file->open(filepath)) {
+        // Map the file rather than reading it in. Nothing is actually read
+        // from disk until a page is touched, so loading costs the same
+        // regardless of file size and only the lines we display ever get
+        // paged in.
+        this->original = this->original_file->data();
+        this->original_size = this->original_file->size();
+
+        // We're about to display the top of the file
+        this->original_file->advise(0, 1 << 20, MappedFile::WillNeed);
+
+        PLOGI << "Mapped " << filepath << " (" << this->original_size << " bytes)";
+    } else {
+        // Fall back to reading the whole file, which is the only option
+        // for things like pipes, and mapping empty files isn't allowed.
+        std::ifstream file(filepath, std::ios::binary);
+
+        if (!file.is_open()) {
+            PLOGE << "Failed to open " << filepath;
+            return;
+        }
+
+        this->original_copy->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        this->original = this->original_copy->data();
+        this->original_size = this->original_copy->size();
+    }
+
+    // Only the lines needed for the first screen are indexed up front,
+    // the rest of the file is indexed in the background.
+    this->index_head();
+
+    this->added.clear();
+    this->pieces.clear();
+
+    if (this->original_size > 0) {
+        this->pieces.insert(0, this->make_piece(Original, 0, this->original_size));
+    }
+
+    this->version = 0;
+    this->saved_version = 0;
+
+    this->read_pos = 0;
+    this->write_pos = 0;
+    this->start_line = 0;
+
+    // The rest has to wait for the whole file to be decompressed, but what
+    // we have of it can be indexed in the meantime
+    if (this->decompressing) {
+        this->start_indexing();
+    } else {
+        this->finish_loading();
+    }
+}
+
+void TextBuffer::finish_loading() {
+    // Pick up whatever edits didn't make it to disk last time
+    this->set_journal_base({std::string_view(this->original, this->original_size)});
+    this->journal.open(this->filepath + ".swap", Journal::file_base(this->filepath), [this](const Journal::Record &record) {
+        this->replay_record(record);
+    });
+
+    this->follow_identity = FileWatcher::identify(this->filepath);
+    this->follow_offset = this->original_size;
+    this->follow_size = this->original_size;
+    this->journal_behind = false;
+
+    this->start_indexing();
+}
+
+bool TextBuffer::decompress_head() {
+    std::FILE *in = std::fopen(this->filepath.c_str(), "rb");
+
+    if (!in) {
+        PLOGE << "Failed to open " << this->filepath;
+        return false;
+    }
+
+    // Just enough is decompressed up front to fill the first screen
+    bool success = decompress_stream(in, this->compression, [this](const char *data, size_t len) {
+        this->original_copy->append(data, len);
+        return this->original_copy->size() < decompress_head_size;
+    });
+
+    std::fclose(in);
+
+    if (!success) {
+        PLOGE << "Failed to decompress " << this->filepath;
+        return false;
+    }
+
+    this->original = this->original_copy->data();
+    this->original_size = this->original_copy->size();
+
+    // The whole file goes next to the compressed one, since the temp
+    // directory is often a small tmpfs that a big log would never fit in.
+    // The file name is only there to make it recognizable, the timestamp
+    // is what keeps two of them apart.
+    std::filesystem::path source(this->filepath);
+    std::filesystem::path name = "." + source.filename().string();
+    name += "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+
+    // A directory we can't write to falls back on the temp directory
+    std::error_code err;
+    std::filesystem::path dirs[] = {source.parent_path(), std::filesystem::temp_directory_path(err)};
+    std::FILE *out = nullptr;
+
+    for (const std::filesystem::path &dir : dirs) {
+        this->decompressed_path = (dir / name).string();
+        out = std::fopen(this->decompressed_path.c_str(), "wb");
+
+        if (out) {
+            break;
+        }
+    }
+
+    if (!out) {
+        PLOGE << "Nowhere to decompress " << this->filepath << " to";
+        this->decompressed_path.clear();
+        return false;
+    }
+
+    this->decompressing = true;
+    this->read_only = true;
+    this->decompress_succeeded = false;
+    this->decompressed_size = 0;
+    this->stop_decompress_thread = false;
+    this->decompress_thread = std::thread(&TextBuffer::decompress_original, this, this->filepath, out);
+    this->set_index_growing(true);
+
+    PLOGI << "Decompressing " << this->filepath << " (" << compression_name(this->compression) << ")";
+
+    return true;
+}
+
+void TextBuffer::decompress_original(std::string path, std::FILE *out) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    std::error_code err;
+    size_t compressed_size = std::filesystem::file_size(path, err);
+    size_t produced = 0;
+    bool success = false;
+
+    std::FILE *in = std::fopen(path.c_str(), "rb");
+
+    if (in) {
+        int write_error = 0;
+
+        success = decompress_stream(in, this->compression, [&](const char *data, size_t len) {
+            if (this->stop_decompress_thread) {
+                return false;
+            }
+
+            if (std::fwrite(data, 1, len, out) != len) {
+                write_error = errno;
+                return false;
+            }
+
+            produced += len;
+
+            if ((produced - len) / decompress_progress_size == produced / decompress_progress_size) {
+                return true;
+            }
+
+            // Everything flushed so far can be mapped and shown while the
+            // rest is still on its way
+            if (std::fflush(out) != 0) {
+                write_error = errno;
+                return false;
+            }
+
+            this->decompressed_size = produced;
+
+            // Progress is measured in compressed bytes, since that's the
+            // only size we know up front
+            if (this->decompress_callback && compressed_size > 0) {
+                this->decompress_callback(float(std::ftell(in)) / compressed_size, false, true);
+            }
+
+            return true;
+        });
+
+        if (!write_error && std::fflush(out) != 0) {
+            write_error = errno;
+        }
+
+        // Usually the disk filling up, in which case we stop there and keep
+        // showing whatever made it out
+        if (write_error) {
+            PLOGE << "Failed to write out " << path << " decompressed: " << std::strerror(write_error);
+        }
+
+        success = success && !write_error && !this->stop_decompress_thread;
+
+        std::fclose(in);
+    }
+
+    std::fclose(out);
+
+    if (success) {
+        auto stop = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> elapsed = stop - start;
+
+        PLOGI
+            << "Decompressed " << produced << " bytes in "
+            << elapsed.count() << "s (" << produced / elapsed.count() / 1e9 << " GB/s)";
+    }
+
+    if (success) {
+        this->decompressed_size = produced;
+    }
+
+    this->decompress_succeeded = success;
+
+    if (this->decompress_callback) {
+        this->decompress_callback(1.0f, true, success);
+    }
+}
+
+bool TextBuffer::sync_decompressed() {
+    size_t size = this->decompressed_size;
+
+    if (!this->decompressing || size <= this->original_size) {
+        return false;
+    }
+
+    // The file is still growing, but the part we're after is already there
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+
+    if (!file->open(this->decompressed_path) || file->size() < size) {
+        return false;
+    }
+
+    this->swap_in_decompressed(file, size);
+
+    return true;
+}
+
+bool TextBuffer::finish_decompressing() {
+    if (!this->decompressing) {
+        return false;
+    }
+
+    if (this->decompress_thread.joinable()) {
+        this->decompress_thread.join();
+    }
+
+    this->decompressing = false;
+
+    if (!this->decompress_succeeded) {
+        PLOGE << "Failed to decompress " << this->filepath << ", only showing the start of it";
+        this->set_index_growing(false);
+
+#ifdef _WIN32
+        // Windows won't delete it while what we have of it is mapped, so
+        // that waits for the next load
+        if (this->original_file->is_open()) {
+            return false;
+        }
+#endif
+
+        this->remove_decompressed();
+        return false;
+    }
+
+    // Whatever's left over since the last sync. An empty file can't be
+    // mapped, but then the start we already have is the whole thing anyway.
+    size_t size = this->decompressed_size;
+
+    if (size > this->original_size) {
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+
+        if (!file->open(this->decompressed_path)) {
+            this->set_index_growing(false);
+            this->remove_decompressed();
+            return false;
+        }
+
+        this->swap_in_decompressed(file, size);
+    }
+
+    // The indexer only has the rest of what it's got left to go
+    this->set_index_growing(false);
+
+#ifndef _WIN32
+    // The mapping keeps the data around, so the file can go right away
+    this->remove_decompressed();
+#endif
+
+    this->read_only = false;
+    this->finish_loading();
+
+    return true;
+}
+
+void TextBuffer::swap_in_decompressed(std::shared_ptr<MappedFile> file, size_t size) {
+    size_t old_size = this->original_size;
+
+    // Snapshots of what we had before hang on to it themselves, and so does
+    // the indexer for the block it's on. The new copy starts with the same
+    // bytes, so the index carries straight over and the indexer just goes
+    // on into the new part.
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+
+        this->original_file = file;
+        this->original_copy = std::make_shared<std::string>();
+        this->original = this->original_file->data();
+        this->original_size = size;
+
+        if (this->line_positions.get_mode() == LineIndex::Sparse) {
+            this->line_positions.set_data(this->original, this->original_size);
+        }
+    }
+
+    this->index_grown.notify_all();
+
+    // Nothing can be edited yet, so the document is just the original, and
+    // everyone hears about the new text as though it had been appended
+    this->begin_transaction();
+
+    this->pieces.clear();
+    this->pieces.insert(0, this->make_piece(Original, 0, this->original_size));
+    this->note_change(old_size, 0, this->original_size - old_size);
+    this->saved_version = this->version;
+
+    this->end_transaction();
+}
+
+void TextBuffer::stop_decompressing() {
+    if (this->decompress_thread.joinable()) {
+        this->stop_decompress_thread = true;
+        this->decompress_thread.join();
+    }
+
+    this->decompressing = false;
+    this->set_index_growing(false);
+}
+
+bool TextBuffer::is_decompressing() {
+    return this->decompressing;
+}
+
+LineEnding TextBuffer::get_line_ending() {
+    return this->line_ending;
+}
+
+void TextBuffer::remove_decompressed() {
+    if (this->decompressed_path.empty()) {
+        return;
+    }
+
+#ifdef _WIN32
+    // Windows won't delete a file that's still mapped
+    if (this->original == this->original_file->data()) {
+        this->original_file = std::make_shared<MappedFile>();
+        this->original = nullptr;
+        this->original_size = 0;
+    }
+#endif
+
+    std::error_code err;
+    std::filesystem::remove(this->decompressed_path, err);
+    this->decompressed_path.clear();
+}
+
+BufferSnapshot TextBuffer::snapshot() const {
+    BufferSnapshot snapshot;
+    snapshot.pieces = this->pieces;
+    snapshot.added = this->added;
+    snapshot.original_file = this->original_file;
+    snapshot.original_copy = this->original_copy;
+    snapshot.original = this->original;
+    snapshot.version = this->version;
+
+    return snapshot;
+}
+
+bool TextBuffer::save_file(std::string path) {
+    if (path.empty()) {
+        path = this->filepath;
+    }
+
+    // Only the start of the file is around yet
+    if (this->read_only) {
+        PLOGW << "Buffer is read only, not saving " << path;
+        return false;
+    }
+
+    // We don't compress on the way out, so that would be one garbled file
+    if (this->compression != Uncompressed && path == this->filepath) {
+        PLOGE << "Not saving over compressed file " << path;
+        return false;
+    }
+
+    if (this->saving) {
+        PLOGW << "Already saving, not saving " << path;
+        return false;
+    }
+
+    // Whatever thread saved last time has finished by now
+    if (this->save_thread.joinable()) {
+        this->save_thread.join();
+    }
+
+    // Saving over the file we loaded means edits from here on get journaled
+    // against what we're about to write
+    bool same_file = path == this->filepath;
+
+    // The save rebases onto everything followed so far as well. A
+    // compaction that's still going doesn't have to finish first, the
+    // save's rebase just ends up after it.
+    if (same_file) {
+        this->save_rebase = this->journal.start_rebase();
+        this->journal_behind = false;
+    }
+
+    this->saving = true;
+    this->save_thread = std::thread(&TextBuffer::write_file, this, this->snapshot(), path, same_file);
+
+    return true;
+}
+
+void TextBuffer::write_file(BufferSnapshot snapshot, std::string path, bool same_file) {
+    // Neither the mapping nor the add buffer ever move existing bytes, so
+    // these stay put however much editing happens while we write them out
+    std::vector<std::string_view> spans = snapshot.spans();
+
+    // Saving through a symlink replaces the file it points at, not the link
+    std::error_code err;
+    std::filesystem::path canonical = std::filesystem::weakly_canonical(path, err);
+    std::string target = err ? path : canonical.string();
+
+    // Everything goes to a temporary file first, which only replaces the
+    // real one once it's safely on disk. Anything going wrong along the way
+    // leaves the original untouched.
+    std::string temp_path = target + ".tmp";
+    size_t total = 0;
+    size_t written = 0;
+    bool success = false;
+
+    for (std::string_view span : spans) {
+        total += span.size();
+    }
+
+    std::FILE *file = std::fopen(temp_path.c_str(), "wb");
+
+    if (file) {
+        success = true;
+
+#ifndef _WIN32
+        // The new file takes the old one's place, permissions and all. Only
+        // root can give a file away though, so the owner is best effort.
+        struct stat st;
+
+        if (stat(target.c_str(), &st) == 0) {
+            if (fchmod(fileno(file), st.st_mode & 07777) != 0) {
+                PLOGW << "Couldn't keep the permissions of " << target;
+            }
+
+            if (fchown(fileno(file), st.st_uid, st.st_gid) != 0) {
+                PLOGW << "Couldn't keep the owner of " << target;
+            }
+        }
+#endif
+
+        for (std::string_view span : spans) {
+            for (size_t offset = 0; success && offset < span.size(); offset += save_chunk_size) {
+                size_t count = std::min(save_chunk_size, span.size() - offset);
+                success = std::fwrite(span.data() + offset, 1, count, file) == count;
+
+                // Only report progress every so often
+                if (written / save_chunk_size != (written + count) / save_chunk_size && this->save_callback) {
+                    this->save_callback(float(written + count) / total, false, true);
+                }
+
+                written += count;
+            }
+        }
+
+        success = std::fflush(file) == 0 && success;
+#ifdef _WIN32
+        success = _commit(_fileno(file)) == 0 && success;
+#else
+        success = fsync(fileno(file)) == 0 && success;
+#endif
+        success = std::fclose(file) == 0 && success;
+    }
+
+    if (success) {
+        // Nothing swaps the mapping out while a save is running
+        success = this->original_file->replace(target, temp_path);
+
+#ifndef _WIN32
+        // The rename itself only sticks once the directory is synced
+        std::filesystem::path dir = std::filesystem::absolute(target).parent_path();
+        int dir_fd = open(dir.c_str(), O_RDONLY);
+
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+#endif
+    }
+
+    if (success) {
+        PLOGI << "Saved " << written << " bytes to " << path;
+    } else {
+        PLOGE << "Failed to save " << path;
+        std::remove(temp_path.c_str());
+    }
+
+    if (same_file && success) {
+        this->set_journal_base(spans);
+        this->journal.finish_rebase(this->save_rebase, Journal::file_base(path), {});
+        this->saved_version = snapshot.get_version();
+
+        // Whatever we follow next gets appended to what we just wrote,
+        // which has taken the old file's place
+        this->follow_identity = FileWatcher::identify(path);
+        this->follow_offset = written;
+        this->follow_size = written;
+    } else if (same_file) {
+        this->journal.cancel_rebase(this->save_rebase);
+    }
+
+    this->saving = false;
+
+    if (this->save_callback) {
+        this->save_callback(1.0f, true, success);
+    }
+}
+
+void TextBuffer::wait_for_save() {
+    if (this->save_thread.joinable()) {
+        this->save_thread.join();
+    }
+}
+
+bool TextBuffer::is_saving() {
+    return this->saving;
+}
+
+bool TextBuffer::is_modified() {
+    return this->version != this->saved_version;
+}
+
+void TextBuffer::replay_record(const Journal::Record &record) {
+    // Anything past the end can't have come from this file
+    if (record.offset > this->pieces.length()) {
+        return;
+    }
+
+    if (record.type == Journal::Insert && !record.text.empty()) {
+        size_t start = this->added.append(record.text);
+        this->insert_piece(record.offset, this->make_piece(Add, start, record.text.size()));
+    } else if (record.type == Journal::Erase) {
+        this->remove_range(record.offset, record.count);
+    }
+
+    this->version++;
+}
+
+void TextBuffer::set_journal_base(const std::vector<std::string_view> &spans) {
+    size_t offset = 0;
+
+    this->journal_base.clear();
+
+    for (std::string_view span : spans) {
+        if (!span.empty()) {
+            this->journal_base.push_back({span.data(), span.size(), offset});
+            offset += span.size();
+        }
+    }
+
+    std::sort(this->journal_base.begin(), this->journal_base.end(), [](const BaseSpan &a, const BaseSpan &b) {
+        return uintptr_t(a.data) < uintptr_t(b.data);
+    });
+}
+
+std::optional<size_t> TextBuffer::find_in_journal_base(const char *data, size_t length) const {
+    auto it = std::upper_bound(this->journal_base.begin(), this->journal_base.end(), uintptr_t(data), [](uintptr_t addr, const BaseSpan &span) {
+        return addr < uintptr_t(span.data);
+    });
+
+    if (it == this->journal_base.begin()) {
+        return {};
+    }
+
+    --it;
+
+    if (uintptr_t(data) + length > uintptr_t(it->data) + it->length) {
+        return {};
+    }
+
+    return it->offset + (uintptr_t(data) - uintptr_t(it->data));
+}
+
+void TextBuffer::extend_journal_base(std::string_view span) {
+    size_t offset = 0;
+
+    for (const BaseSpan &base_span : this->journal_base) {
+        offset += base_span.length;
+    }
+
+    // Text followed from disk usually lands right after the last lot in the
+    // add buffer, and the pieces holding it get merged, so the spans are too
+    for (BaseSpan &base_span : this->journal_base) {
+        if (base_span.data + base_span.length == span.data() && base_span.offset + base_span.length == offset) {
+            base_span.length += span.size();
+            return;
+        }
+    }
+
+    auto it = std::upper_bound(this->journal_base.begin(), this->journal_base.end(), uintptr_t(span.data()), [](uintptr_t addr, const BaseSpan &base_span) {
+        return addr < uintptr_t(base_span.data);
+    });
+
+    this->journal_base.insert(it, {span.data(), span.size(), offset});
+}
+
+std::vector<Journal::Record> TextBuffer::journal_records() const {
+    // Pieces whose text is already in the base file in order just mean the
+    // bytes in between were erased, anything else has to be inserted as is
+    std::vector<Journal::Record> records;
+    size_t doc_pos = 0;
+    size_t base_pos = 0;
+    size_t base_size = 0;
+
+    for (const BaseSpan &span : this->journal_base) {
+        base_size += span.length;
+    }
+
+    for (size_t i = 0; i < this->pieces.count(); ++i) {
+        const Piece &piece = this->pieces.at(i);
+        const char *data = this->piece_data(piece);
+        std::optional<size_t> base_offset = this->find_in_journal_base(data, piece.length);
+
+        if (base_offset.has_value() && *base_offset >= base_pos) {
+            if (*base_offset > base_pos) {
+                records.push_back({Journal::Erase, doc_pos, *base_offset - base_pos, {}});
+            }
+
+            base_pos = *base_offset + piece.length;
+        } else {
+            records.push_back({Journal::Insert, doc_pos, piece.length, {data, piece.length}});
+        }
+
+        doc_pos += piece.length;
+    }
+
+    if (base_pos < base_size) {
+        records.push_back({Journal::Erase, doc_pos, base_size - base_pos, {}});
+    }
+
+    return records;
+}
+
+void TextBuffer::compact_journal() {
+    // Saving rebases the journal itself
+    if (this->saving || !this->journal.should_compact()) {
+        return;
+    }
+
+    this->journal.compact(this->journal_records());
+}
+
+void TextBuffer::rebase_journal() {
+    // A file that keeps on growing would otherwise be rebased every frame,
+    // so this waits for the last one to finish instead
+    if (!this->journal_behind || this->saving || this->journal.is_rebasing()) {
+        return;
+    }
+
+    // Whatever's on disk past what we've read is left alone by the records,
+    // so the base can be the file as it is now
+    this->journal.rebase(Journal::file_base(this->filepath), this->journal_records());
+    this->journal_behind = false;
+}
+
+void TextBuffer::reload_file() {
+    if (this->reload_callback) {
+        this->reload_callback(false);
+    }
+
+    if (this->is_modified()) {
+        PLOGW << "Dropping unsaved changes to " << this->filepath;
+    }
+
+    // The whole document is replaced, which subscribers hear about as one
+    // change like any other
+    size_t old_length = this->pieces.length();
+
+    this->begin_transaction();
+    this->load_file(this->filepath);
+    this->note_change(0, old_length, this->pieces.length());
+    this->saved_version = this->version;
+    this->end_transaction();
+
+    this->follow(true);
+
+    if (this->reload_callback) {
+        this->reload_callback(true);
+    }
+}
+
+bool TextBuffer::follow(bool enable) {
+    // There's no telling where the new text starts in a compressed stream
+    if (enable && this->compression != Uncompressed) {
+        PLOGW << "Can't follow compressed file " << this->filepath;
+        return false;
+    }
+
+    if (!enable) {
+        this->follow_watcher.stop();
+    } else if (!this->follow_watcher.is_watching()) {
+        this->follow_watcher.watch(this->filepath);
+    }
+
+    return this->follow_watcher.is_watching();
+}
+
+bool TextBuffer::is_following() {
+    return this->follow_watcher.is_watching();
+}
+
+size_t TextBuffer::poll_follow() {
+    // The save thread moves the follow offset once it's done
+    if (!this->follow_watcher.is_watching() || this->saving) {
+        return 0;
+    }
+
+    // A single poll covers however many writes happened since the last,
+    // so a file that grows constantly only gets read once per frame
+    if (this->follow_watcher.poll()) {
+        std::error_code err;
+        size_t size = std::filesystem::file_size(this->filepath, err);
+        FileWatcher::Identity identity = FileWatcher::identify(this->filepath);
+
+        if (err || identity == FileWatcher::Identity{0, 0}) {
+            return 0;
+        }
+
+        if (size < this->follow_offset || identity != this->follow_identity) {
+            // Truncated or rotated, either way there's no telling what
+            // changed. The mapping can't be touched past the new end either,
+            // so the whole file is loaded again. A rotated file can easily
+            // be bigger than ours already, so that goes by its identity.
+            PLOGW << this->filepath << (identity != this->follow_identity ? " was replaced" : " shrank") << ", reloading it";
+            this->reload_file();
+            return this->original_size;
+        }
+
+        this->follow_size = size;
+    }
+
+    this->rebase_journal();
+
+    if (this->follow_offset >= this->follow_size) {
+        return 0;
+    }
+
+    std::ifstream file(this->filepath, std::ios::binary);
+
+    if (!file.is_open()) {
+        return 0;
+    }
+
+    std::string text(std::min(this->follow_size - this->follow_offset, follow_chunk_size), '\0');
+
+    file.seekg(this->follow_offset);
+    file.read(text.data(), text.size());
+    text.resize(file.gcount());
+
+    if (text.empty()) {
+        return 0;
+    }
+
+    this->follow_offset += text.size();
+
+    // The new text is already on disk, so there's nothing to journal and
+    // the buffer is no more modified than it was
+    bool was_modified = this->is_modified();
+
+    this->appending_from_disk = true;
+    this->append_text(text);
+    this->appending_from_disk = false;
+
+    if (!was_modified) {
+        this->saved_version = this->version;
+    }
+
+    // The new text always ends the last piece, merged in or not
+    const Piece &last = this->pieces.at(this->pieces.count() - 1);
+    this->extend_journal_base({this->piece_data(last) + last.length - text.size(), text.size()});
+    this->journal_behind = true;
+    this->rebase_journal();
+
+    return text.size();
+}
+
+void TextBuffer::set_index_mode(LineIndex::Mode mode, size_t memory_cap) {
+    this->index_mode = mode;
+    this->index_memory_cap = memory_cap;
+}
+
+void TextBuffer::index_head() {
+    // Find the end of the first `max_buffer_height` lines
+    const char *end = this->original + this->original_size;
+    const char *cursor = this->original;
+
+    for (unsigned int i = 0; i < this->max_buffer_height && cursor < end; ++i) {
+        const char *newline = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+        cursor = newline ? newline + 1 : end;
+    }
+
+    // Nothing else is running yet, but the lock keeps things consistent
+    std::lock_guard<std::mutex> lock(this->index_mutex);
+
+    std::vector<uint64_t> head_positions;
+    find_line_starts(this->original, cursor - this->original, 0, head_positions);
+
+    if (this->index_mode == LineIndex::Sparse) {
+        this->line_positions.use_sparse(this->original, this->original_size, this->index_memory_cap);
+    } else {
+        this->line_positions.use_dense();
+    }
+
+    this->line_positions.push_back(0);
+    this->line_positions.append(head_positions.data(), head_positions.size());
+
+    this->indexed_size = cursor - this->original;
+    this->index_frontier = this->indexed_size;
+
+    this->detect_line_ending(this->original, this->indexed_size);
+
+    this->validated_size = 0;
+    this->valid_utf8 = true;
+    this->validate_original(this->original, this->original_size, this->indexed_size);
+}
+
+void TextBuffer::detect_line_ending(const char *data, size_t length) {
+    // Going by the majority of the first screenful of lines copes with the
+    // odd stray line ending, and files with no newlines at all are LF
+    size_t crlf = 0;
+    size_t lf = 0;
+    const char *end = data + length;
+
+    for (const char *cursor = data; cursor < end; ++cursor) {
+        cursor = static_cast<const char*>(memchr(cursor, '\n', end - cursor));
+
+        if (!cursor) {
+            break;
+        }
+
+        if (cursor > data && cursor[-1] == '\r') {
+            crlf++;
+        } else {
+            lf++;
+        }
+    }
+
+    this->line_ending = crlf > lf ? CRLF : LF;
+
+    if (this->line_ending == CRLF) {
+        PLOGI << this->filepath << " has CRLF line endings";
+    }
+}
+
+void TextBuffer::validate_original(const char *data, size_t size, size_t stop) {
+    // A sequence can straddle the end of a block, in which case it's left
+    // for the next one
+    for (int i = 0; i < 3 && stop < size && stop > this->validated_size; ++i) {
+        if ((data[stop] & 0xC0) != 0x80) {
+            break;
+        }
+
+        stop--;
+    }
+
+    // One warning is enough, there's no point checking the rest after that
+    if (this->valid_utf8 && !validate_utf8(data + this->validated_size, stop - this->validated_size)) {
+        PLOGW << this->filepath << " isn't valid UTF-8, invalid bytes will show up as U+FFFD";
+        this->valid_utf8 = false;
+    }
+
+    this->validated_size = stop;
+}
+
+void TextBuffer::normalize_newlines(std::string &text, size_t offset) const {
+    if (this->line_ending == LF || text.find('\n') == std::string::npos) {
+        return;
+    }
+
+    // A newline landing right after a '\r' that's already in the document
+    // completes that line ending rather than starting a new one
+    std::string before;
+
+    if (offset > 0) {
+        this->read_range(offset - 1, offset, before);
+    }
+
+    std::string normalized;
+    normalized.reserve(text.size() + text.size() / 16);
+
+    char prev = before.empty() ? '\0' : before[0];
+
+    for (char c : text) {
+        if (c == '\n' && prev != '\r') {
+            normalized.push_back('\r');
+        }
+
+        normalized.push_back(c);
+        prev = c;
+    }
+
+    text = std::move(normalized);
+}
+
+void TextBuffer::index_original() {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    size_t offset;
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        offset = this->indexed_size;
+    }
+
+    size_t first_offset = offset;
+    std::vector<uint64_t> block_positions;
+
+    // Our own hold on the original, which a decompressing file swaps out
+    // from under us for a longer copy now and then
+    std::shared_ptr<MappedFile> file;
+    std::shared_ptr<std::string> copy;
+    const char *data = nullptr;
+    size_t size = 0;
+
+    // Each block is indexed across every core without holding the lock,
+    // and then appended to the shared index in one go. A sparse index only
+    // keeps the odd line start, so rather than find them all first, it
+    // scans for the ones it wants itself.
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(this->index_mutex);
+
+            // There's more on the way for as long as the file's still
+            // decompressing
+            this->index_grown.wait(lock, [&]() {
+                return offset < this->original_size || !this->index_growing || this->stop_index_thread;
+            });
+
+            if (offset >= this->original_size || this->stop_index_thread) {
+                this->index_running = false;
+                break;
+            }
+
+            if (data != this->original) {
+                file = this->original_file;
+                copy = this->original_copy;
+                data = this->original;
+                file->advise(offset, this->original_size - offset, MappedFile::Sequential);
+            }
+
+            size = this->original_size;
+        }
+
+        size_t block_length = std::min(index_block_size, size - offset);
+        size_t block_stop = offset + block_length;
+
+        if (this->line_positions.get_mode() == LineIndex::Sparse) {
+            while (offset < block_stop && !this->stop_index_thread) {
+                size_t step_stop = std::min(offset + sparse_index_step, block_stop);
+
+                std::lock_guard<std::mutex> lock(this->index_mutex);
+                this->line_positions.scan(offset, step_stop);
+                this->indexed_size = step_stop;
+                offset = step_stop;
+            }
+        } else {
+            block_positions.clear();
+            build_line_index(data + offset, block_length, offset, block_positions);
+            offset = block_stop;
+
+            std::lock_guard<std::mutex> lock(this->index_mutex);
+            this->line_positions.append(block_positions.data(), block_positions.size());
+            this->indexed_size = offset;
+        }
+
+        this->validate_original(data, size, offset);
+
+        if (this->index_callback) {
+            this->index_callback(float(offset) / size);
+        }
+    }
+
+    if (file) {
+        file->advise(0, size, MappedFile::Normal);
+    }
+
+    // Growing the index left some slack behind
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        this->line_positions.shrink_to_fit();
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed = stop - start;
+
+    PLOGI
+        << "Indexed " << this->line_positions.size() << " lines in "
+        << elapsed.count() * 1000.0 << "ms ("
+        << (offset - first_offset) / elapsed.count() / 1e9 << " GB/s), index uses "
+        << this->line_positions.memory_usage() << " bytes";
 }
 
-void TextBuffer::register_callback(callable_t cb) {
-    this->callback = cb;
+bool TextBuffer::sync_index() {
+    size_t frontier;
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        frontier = this->indexed_size;
+    }
+
+    if (frontier == this->index_frontier) {
+        return false;
+    }
+
+    // Only pieces reaching past the old frontier have gained any newlines
+    size_t old_frontier = this->index_frontier;
+    this->index_frontier = frontier;
+
+    this->pieces.transform_original(old_frontier, [this](Piece &piece) {
+        piece = this->make_piece(Original, piece.start, piece.length);
+    });
+
+    return true;
 }
 
-void TextBuffer::load_file(std::string filepath) {
-    std::ifstream t;
-    t.open(filepath);
-    std::stringstream buffer;
-    buffer << t.rdbuf();
-    t.close();
+void TextBuffer::stop_indexing() {
+    if (this->index_thread.joinable()) {
+        {
+            // Under the lock so a thread waiting for more can't miss it
+            std::lock_guard<std::mutex> lock(this->index_mutex);
+            this->stop_index_thread = true;
+        }
+
+        this->index_grown.notify_all();
+        this->index_thread.join();
+    }
+}
 
-    std::string s = buffer.str();
+void TextBuffer::start_indexing() {
+    // A thread that's still going gets to the rest by itself
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
 
-    this->stream = std::fstream(filepath + ".swap", std::fstream::in | std::fstream::out);
+        if (this->index_running) {
+            return;
+        }
+    }
 
-    //this->stream.open(filepath + ".swap", std::fstream::in | std::fstream::out);
-    this->stream.write(s.c_str(), s.length());
-    this->stream.seekp(0, this->stream.beg);
+    // Otherwise whatever thread indexed last time has finished or been
+    // stopped, and this carries on from where it got to
+    this->stop_indexing();
 
-    this->line_positions.push_back(0);
+    if (this->indexed_size < this->original_size || this->index_growing) {
+        this->stop_index_thread = false;
+        this->index_running = true;
+        this->index_thread = std::thread(&TextBuffer::index_original, this);
+    }
+}
+
+void TextBuffer::set_index_growing(bool growing) {
+    {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        this->index_growing = growing;
+    }
+
+    this->index_grown.notify_all();
+}
+
+bool TextBuffer::is_indexing() {
+    return this->index_frontier < this->original_size;
+}
+
+size_t TextBuffer::line_count() {
+    size_t newlines = this->pieces.newlines();
+
+    // Until indexing is done, assume the rest of the original
+    // has as many lines per byte as what we've seen so far
+    if (this->index_frontier > 0 && this->index_frontier < this->original_size) {
+        double lines_per_byte = double(newlines) / this->index_frontier;
+        newlines += lines_per_byte * (this->original_size - this->index_frontier);
+    }
+
+    return newlines + 1;
+}
+
+Piece TextBuffer::make_piece(PieceSource source, size_t start, size_t length) const {
+    size_t newlines;
+
+    if (source == Original) {
+        // Newlines in the original can just be counted as the line starts
+        // that fall within (start, start + length], as far as they've been
+        // indexed anyway
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        size_t stop = std::min(start + length, this->index_frontier);
+
+        newlines = start < stop ? this->line_positions.upper_bound(stop) - this->line_positions.upper_bound(start) : 0;
+    } else {
+        newlines = count_newlines(this->added.data(start), length);
+    }
+
+    return {source, start, length, newlines};
+}
+
+const char *TextBuffer::piece_data(const Piece &piece) const {
+    if (piece.source == Original) {
+        return this->original + piece.start;
+    } else {
+        return this->added.data(piece.start);
+    }
+}
+
+void TextBuffer::insert_piece(size_t offset, Piece piece) {
+    PieceTree::Location loc = this->pieces.find_offset(offset);
+
+    if (loc.offset == 0) {
+        // Consecutive inserts (i.e. typing) land right after the add piece
+        // we created last time, so we can just grow that piece.
+        if (loc.index > 0) {
+            Piece prev = this->pieces.at(loc.index - 1);
+
+            if (prev.source == Add && piece.source == Add && prev.start + prev.length == piece.start) {
+                prev.length += piece.length;
+                prev.newlines += piece.newlines;
+                this->pieces.set(loc.index - 1, prev);
+                return;
+            }
+        }
+
+        this->pieces.insert(loc.index, piece);
+    } else {
+        // Split the piece we landed in and put the new piece in between
+        Piece target = this->pieces.at(loc.index);
+        Piece head = this->make_piece(target.source, target.start, loc.offset);
+        Piece tail = this->make_piece(target.source, target.start + loc.offset, target.length - loc.offset);
+
+        this->pieces.set(loc.index, head);
+        this->pieces.insert(loc.index + 1, piece);
+        this->pieces.insert(loc.index + 2, tail);
+    }
+}
+
+void TextBuffer::remove_range(size_t offset, size_t count) {
+    if (offset >= this->pieces.length()) {
+        return;
+    }
+
+    count = std::min(count, this->pieces.length() - offset);
+
+    if (count == 0) {
+        return;
+    }
+
+    PieceTree::Location loc = this->pieces.find_offset(offset);
+    size_t idx = loc.index;
+    size_t remaining = count;
+
+    if (loc.offset > 0) {
+        Piece target = this->pieces.at(idx);
+        Piece head = this->make_piece(target.source, target.start, loc.offset);
+
+        if (loc.offset + remaining < target.length) {
+            // The removed range is entirely inside of one piece
+            Piece tail = this->make_piece(
+                target.source,
+                target.start + loc.offset + remaining,
+                target.length - loc.offset - remaining);
+
+            this->pieces.set(idx, head);
+            this->pieces.insert(idx + 1, tail);
+            return;
+        }
+
+        remaining -= target.length - loc.offset;
+        this->pieces.set(idx, head);
+        idx++;
+    }
+
+    // Drop every piece that is covered completely, then trim the front of
+    // the piece where the range ends.
+    while (remaining > 0 && remaining >= this->pieces.at(idx).length) {
+        remaining -= this->pieces.at(idx).length;
+        this->pieces.erase(idx);
+    }
+
+    if (remaining > 0) {
+        Piece target = this->pieces.at(idx);
+        this->pieces.set(idx, this->make_piece(target.source, target.start + remaining, target.length - remaining));
+    }
+}
+
+std::optional<size_t> TextBuffer::line_offset(size_t line) const {
+    if (line == 0) {
+        return 0;
+    }
+
+    // Until indexing is done, pieces of the original only count the
+    // newlines before the frontier, so the counts in the tree can't be
+    // trusted for anything after the first piece that reaches past it
+    if (this->index_frontier < this->original_size) {
+        return this->scan_line_offset(line);
+    }
+
+    // Line `n` starts just past the `n`th newline in the document
+    std::optional<PieceTree::Location> loc = this->pieces.find_newline(line);
+
+    if (!loc.has_value()) {
+        return {};
+    }
+
+    const Piece &piece = this->pieces.at(loc->index);
+    return loc->start + this->piece_line_offset(piece, line - loc->newlines_before);
+}
+
+std::optional<size_t> TextBuffer::scan_line_offset(size_t line) const {
+    // The pieces are walked in order, and only the parts of the original
+    // that haven't been indexed yet are actually scanned, which costs
+    // about as much as how far past the frontier the line is
+    size_t start = 0;
+
+    for (size_t i = 0; i < this->pieces.count(); ++i) {
+        const Piece &piece = this->pieces.at(i);
+
+        if (line <= piece.newlines) {
+            return start + this->piece_line_offset(piece, line);
+        }
+
+        line -= piece.newlines;
+
+        if (piece.source == Original && piece.start + piece.length > this->index_frontier) {
+            size_t indexed = this->index_frontier > piece.start ? this->index_frontier - piece.start : 0;
+            const char *data = this->original + piece.start + indexed;
+            const char *newline = find_nth_newline(data, piece.length - indexed, line);
+
+            if (newline) {
+                return start + indexed + (newline - data) + 1;
+            }
+
+            line -= count_newlines(data, piece.length - indexed);
+        }
+
+        start += piece.length;
+    }
+
+    return {};
+}
+
+size_t TextBuffer::piece_line_offset(const Piece &piece, size_t n) const {
+    if (piece.source == Original) {
+        std::lock_guard<std::mutex> lock(this->index_mutex);
+        size_t first = this->line_positions.upper_bound(piece.start);
+        return this->line_positions.at(first + n - 1) - piece.start;
+    }
+
+    const char *data = this->piece_data(piece);
+    return find_nth_newline(data, piece.length, n) + 1 - data;
 }
 
 void TextBuffer::inc_start_line() {
@@ -48,56 +1383,344 @@ void TextBuffer::dec_stop_line() {
     this->stop_line--;
 }
 
+void TextBuffer::set_cursor(size_t offset) {
+    this->write_pos = std::min(offset, this->pieces.length());
+}
+
+size_t TextBuffer::get_cursor() {
+    return this->write_pos;
+}
+
+size_t TextBuffer::size() {
+    return this->pieces.length();
+}
+
+void TextBuffer::begin_transaction() {
+    if (this->transaction_depth++ == 0) {
+        this->transaction_changed = false;
+        this->transaction_newlines = this->pieces.newlines();
+    }
+}
+
+void TextBuffer::end_transaction() {
+    if (this->transaction_depth == 0 || --this->transaction_depth > 0 || !this->transaction_changed) {
+        return;
+    }
+
+    // Nothing outside the changed range gained or lost any newlines, so
+    // the difference over the whole document tells us how many lines the
+    // range used to have
+    size_t first_line = this->line_at(this->change_offset);
+    size_t inserted_lines = this->line_at(this->change_offset + this->change_inserted) - first_line;
+    size_t removed_lines = inserted_lines + this->transaction_newlines - this->pieces.newlines();
+
+    BufferChange change = {
+        this->version,
+        this->change_offset,
+        this->change_removed,
+        this->change_inserted,
+        first_line,
+        removed_lines,
+        inserted_lines,
+    };
+
+    for (const change_callable_t &cb : this->change_callbacks) {
+        cb(change);
+    }
+}
+
+void TextBuffer::note_change(size_t offset, size_t removed, size_t inserted) {
+    this->version++;
+
+    if (!this->transaction_changed) {
+        this->transaction_changed = true;
+        this->change_offset = offset;
+        this->change_removed = removed;
+        this->change_inserted = inserted;
+        return;
+    }
+
+    // Grow the change to cover both ranges. Everything before the start is
+    // untouched, and everything past the end has only been shifted, so the
+    // two ends are easy to map back to the old document.
+    size_t start = std::min(this->change_offset, offset);
+    size_t stop = std::max(this->change_offset + this->change_inserted, offset + removed);
+    size_t old_stop = stop - this->change_inserted + this->change_removed;
+
+    this->change_offset = start;
+    this->change_removed = old_stop - start;
+    this->change_inserted = stop - removed + inserted - start;
+}
+
+size_t TextBuffer::line_at(size_t offset) const {
+    PieceTree::Location loc = this->pieces.find_offset(offset);
+
+    if (loc.offset == 0) {
+        return loc.newlines_before;
+    }
+
+    const Piece &piece = this->pieces.at(loc.index);
+    return loc.newlines_before + this->make_piece(piece.source, piece.start, loc.offset).newlines;
+}
+
 void TextBuffer::append_text(std::string text) {
-    long pos = this->stream.tellp();
-    this->stream.seekp(0, this->stream.end);
-    this->stream.write(text.c_str(), text.size());
-    this->stream.seekp(pos);
+    if (text.empty() || this->read_only) {
+        return;
+    }
+
+    size_t offset = this->pieces.length();
+
+    // Text from disk is already in the file's own convention
+    if (!this->appending_from_disk) {
+        this->normalize_newlines(text, offset);
+        this->journal.record_insert(offset, text);
+    }
+
+    this->begin_transaction();
+
+    size_t start = this->added.append(text);
+    this->insert_piece(offset, this->make_piece(Add, start, text.size()));
+    this->note_change(offset, 0, text.size());
+
+    this->end_transaction();
+    this->compact_journal();
 }
 
 void TextBuffer::insert_text(std::string text) {
-    this->stream.write(text.c_str(), text.size());
+    if (text.empty() || this->read_only) {
+        return;
+    }
+
+    this->normalize_newlines(text, this->write_pos);
+    this->journal.record_insert(this->write_pos, text);
+
+    this->begin_transaction();
+
+    size_t start = this->added.append(text);
+    this->insert_piece(this->write_pos, this->make_piece(Add, start, text.size()));
+    this->note_change(this->write_pos, 0, text.size());
+
+    if (this->read_pos > this->write_pos) {
+        this->read_pos += text.size();
+    }
+
+    this->write_pos += text.size();
+
+    this->end_transaction();
+    this->compact_journal();
 }
 
-std::optional<std::string> TextBuffer::read_prev_line() {
-    return {};
+void TextBuffer::erase_text(size_t count) {
+    if (this->read_only) {
+        return;
+    }
+
+    size_t old_length = this->pieces.length();
+
+    this->begin_transaction();
+    this->remove_range(this->write_pos, count);
+
+    size_t removed = old_length - this->pieces.length();
+
+    if (removed > 0) {
+        this->journal.record_erase(this->write_pos, removed);
+        this->note_change(this->write_pos, removed, 0);
+
+        if (this->read_pos > this->write_pos) {
+            this->read_pos = std::max(this->write_pos, this->read_pos - removed);
+        }
+    }
+
+    this->end_transaction();
+    this->compact_journal();
 }
 
-std::optional<std::string> TextBuffer::read_next_line() {
-    if (!this->stream.is_open()) {
-        PLOGE << "Stream not open";
+void TextBuffer::read_range(size_t start, size_t stop, std::string &out) const {
+    PieceTree::Location loc = this->pieces.find_offset(start);
+    size_t inner = loc.offset;
+
+    out.clear();
+    out.reserve(stop - start);
+
+    for (size_t idx = loc.index; start < stop; ++idx, inner = 0) {
+        const Piece &piece = this->pieces.at(idx);
+        size_t count = std::min(piece.length - inner, stop - start);
+
+        out.append(this->piece_data(piece) + inner, count);
+        start += count;
+    }
+}
+
+std::string_view TextBuffer::view_range(size_t start, size_t stop, std::string &scratch) const {
+    PieceTree::Location loc = this->pieces.find_offset(start);
+
+    // Most lines sit inside a single piece, and can be handed out as is
+    if (loc.index < this->pieces.count()) {
+        const Piece &piece = this->pieces.at(loc.index);
+
+        if (loc.offset + (stop - start) <= piece.length) {
+            return std::string_view(this->piece_data(piece) + loc.offset, stop - start);
+        }
+    }
+
+    // Otherwise the pieces get stitched together in the scratch space
+    this->read_range(start, stop, scratch);
+    return scratch;
+}
+
+// Lines are split on '\n' alone, which leaves the '\r' of a CRLF behind
+static std::string_view strip_line_ending(std::string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+
+    return line;
+}
+
+std::optional<std::string_view> TextBuffer::next_line_view(std::string &scratch) {
+    if (this->read_pos >= this->pieces.length()) {
         return {};
     }
 
-    std::string line;
+    PieceTree::Location loc = this->pieces.find_offset(this->read_pos);
+    size_t inner = loc.offset;
+    size_t piece_start = loc.start;
+    size_t start = this->read_pos;
+    size_t stop = this->pieces.length();
 
-    if (getline(this->stream, line)) {
-        this->start_line++;
+    // A line can span any number of pieces, so keep looking
+    // until we run into a newline or the end of the document.
+    for (size_t idx = loc.index; idx < this->pieces.count(); ++idx, inner = 0) {
+        const Piece &piece = this->pieces.at(idx);
+        const char *data = this->piece_data(piece);
 
-        if (this->line_positions.size() <= this->start_line) {
-            this->line_positions.push_back(this->stream.tellg());
-        } else {
-            this->line_positions[this->start_line] = this->stream.tellg();
+        const char *newline = static_cast<const char*>(memchr(data + inner, '\n', piece.length - inner));
+
+        if (newline) {
+            stop = piece_start + (newline - data);
+            break;
         }
 
-        return line;
+        piece_start += piece.length;
     }
 
-    return {};
+    this->read_pos = stop < this->pieces.length() ? stop + 1 : stop;
+    this->start_line++;
+
+    return strip_line_ending(this->view_range(start, stop, scratch));
+}
+
+std::optional<std::string_view> TextBuffer::prev_line_view(std::string &scratch) {
+    if (this->read_pos == 0) {
+        return {};
+    }
+
+    // Start with the piece holding the byte right before us, which is
+    // usually the newline ending the previous line
+    PieceTree::Location loc = this->pieces.find_offset(this->read_pos - 1);
+    const Piece *piece = &this->pieces.at(loc.index);
+    const char *data = this->piece_data(*piece);
+
+    size_t idx = loc.index;
+    size_t piece_start = loc.start;
+    size_t available = loc.offset + 1;
+    size_t stop = this->read_pos;
+
+    if (data[available - 1] == '\n') {
+        available--;
+        stop--;
+    }
+
+    // Scan backwards for the newline before that one, a whole piece at a
+    // time, which mirrors how `next_line_view` scans forwards
+    size_t start = 0;
+
+    while (true) {
+        const char *newline = find_last_newline(data, available);
+
+        if (newline) {
+            start = piece_start + (newline - data) + 1;
+            break;
+        }
+
+        if (idx == 0) {
+            break;
+        }
+
+        piece = &this->pieces.at(--idx);
+        data = this->piece_data(*piece);
+        available = piece->length;
+        piece_start -= piece->length;
+    }
+
+    this->read_pos = start;
+
+    if (this->start_line > 0) {
+        this->start_line--;
+    }
+
+    return strip_line_ending(this->view_range(start, stop, scratch));
+}
+
+std::optional<std::string_view> TextBuffer::read_next_line_view() {
+    return this->next_line_view(this->line_scratch);
+}
+
+std::optional<std::string_view> TextBuffer::read_prev_line_view() {
+    return this->prev_line_view(this->line_scratch);
+}
+
+std::span<const std::string_view> TextBuffer::read_lines(unsigned int first_line, size_t count) {
+    this->seek_line(first_line);
+
+    // Every line gets its own scratch string, since a view into a shared one
+    // wouldn't survive reading the next line. Both vectors keep their
+    // capacity, so once they've grown to fit the viewport nothing allocates.
+    if (this->lines_scratch.size() < count) {
+        this->lines_scratch.resize(count);
+    }
+
+    this->line_views.clear();
+
+    for (size_t i = 0; i < count; ++i) {
+        std::optional<std::string_view> line = this->next_line_view(this->lines_scratch[i]);
+
+        if (!line.has_value()) {
+            break;
+        }
+
+        this->line_views.push_back(*line);
+    }
+
+    return this->line_views;
+}
+
+std::optional<std::string> TextBuffer::read_prev_line() {
+    std::optional<std::string_view> line = this->read_prev_line_view();
+
+    if (!line.has_value()) {
+        return {};
+    }
+
+    return std::string(*line);
+}
+
+std::optional<std::string> TextBuffer::read_next_line() {
+    std::optional<std::string_view> line = this->read_next_line_view();
+
+    if (!line.has_value()) {
+        return {};
+    }
+
+    return std::string(*line);
 }
 
 void TextBuffer::seek_line(unsigned int line_num) {
     PLOGD << "Seeking line " << line_num;
-    this->stream.clear();
 
-    if (this->line_positions.size() <= line_num) {
-        this->start_line = this->line_positions.size() - 1;
-        this->stream.seekg(this->line_positions[this->start_line]);
-        while (this->read_next_line().has_value() && this->start_line < line_num);
-    } else {
-        this->start_line = line_num;
-        this->stream.seekg(this->line_positions[this->start_line]);
-    }
+    // Seeking past the last line leaves us at the end of the document
+    this->start_line = line_num;
+    this->read_pos = this->line_offset(line_num).value_or(this->pieces.length());
 }
 
 void TextBuffer::set_max_buffer_height(unsigned int height) {
@@ -12,53 +12,90 @@
 #include "vigor/global.h"
 #include "vigor/text_buffer.h"
 #include "vigor/text_layer.h"
+#include "vigor/utf8.h"
 #include "vigor/window.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-#define VEC2(TARGET, INDEX, V1, V2) {\
-    TARGET[2 * (INDEX)    ] = V1;\
-    TARGET[2 * (INDEX) + 1] = V2;\
-}
+using std::string;
 
-#define VEC3(TARGET, INDEX, V1, V2, V3) {\
-    TARGET[3 * (INDEX)    ] = V1;\
-    TARGET[3 * (INDEX) + 1] = V2;\
-    TARGET[3 * (INDEX) + 2] = V3;\
-}
+std::map<char32_t, Glyph> glyphs;
+
+// Codepoints that get rasterized into the atlas up front. Anything else is
+// drawn as the replacement character (or '?' if the font doesn't have one).
+static const std::pair<char32_t, char32_t> glyph_ranges[] = {
+    {0x0000, 0x007F}, // ASCII
+    {0x00A0, 0x017F}, // Latin-1 Supplement, Latin Extended-A
+    {0x0370, 0x03FF}, // Greek
+    {0x0400, 0x04FF}, // Cyrillic
+    {0x2010, 0x2027}, // General punctuation (dashes, quotes, ellipsis)
+    {0x2190, 0x21FF}, // Arrows
+    {0x2500, 0x259F}, // Box drawing, block elements
+    {0xFFFD, 0xFFFD}, // Replacement character
+};
+
+static Glyph find_glyph(char32_t c) {
+    auto it = glyphs.find(c);
+
+    if (it == glyphs.end()) {
+        it = glyphs.find(replacement_character);
+    }
 
-#define VEC4(TARGET, INDEX, V1, V2, V3, V4) {\
-    TARGET[4 * (INDEX)    ] = V1;\
-    TARGET[4 * (INDEX) + 1] = V2;\
-    TARGET[4 * (INDEX) + 2] = V3;\
-    TARGET[4 * (INDEX) + 3] = V4;\
+    if (it == glyphs.end()) {
+        it = glyphs.find('?');
+    }
+
+    return it != glyphs.end() ? it->second : Glyph{};
 }
 
-using std::string;
+// Nearly every cell is ASCII, so those skip the map
+static GLushort ascii_glyph_ids[0x80];
 
-std::map<GLchar, Glyph> glyphs;
+static GLushort find_glyph_id(char32_t c) {
+    return c < 0x80 ? ascii_glyph_ids[c] : find_glyph(c).id;
+}
+
+// Colors for each `CellStyle`
+static const glm::vec4 style_colors[StyleCount] = {
+    glm::vec4(1.0f, 1.0f, 1.0f, 1.0f), // DefaultStyle
+    glm::vec4(1.0f, 0.8f, 0.2f, 1.0f), // MatchStyle
+};
 
 void TextLayer::setup() {
-    glGenBuffers(1, &this->vbo_vertices);
-    glGenBuffers(1, &this->vbo_uvs);
-    glGenBuffers(1, &this->vbo_colors);
-    glGenBuffers(1, &this->ibo_faces);
+    if (this->render_mode == GridRender) {
+        glGenTextures(1, &this->grid_texture_id);
+    } else {
+        glGenBuffers(1, &this->vbo_instances);
 
-    // This odd line forces the layer to do a full redraw
-    // the next time `calculate_attribute_buffers` is called.
-    this->last_y = 1.0f;
+        // The instance layout never changes, so it's set up once and kept in
+        // a vertex array of our own. Other layers draw with whatever vertex
+        // array is bound, so that has to be put back afterwards.
+        GLint previous_vao;
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous_vao);
 
-    // FIX: Not sure about this magic number
-    this->last_start_line = -this->rows + 2;
+        glGenVertexArrays(1, &this->vao);
+        glBindVertexArray(this->vao);
 
-    this->bottom_line_idx = this->rows - 1;
+        GLint cell_position = glGetAttribLocation(this->shader_id, "cell");
+        glEnableVertexAttribArray(cell_position);
+        glBindBuffer(GL_ARRAY_BUFFER, this->vbo_instances);
+        glVertexAttribIPointer(cell_position, 4, GL_UNSIGNED_SHORT, sizeof(CellInstance), 0);
+        glVertexAttribDivisor(cell_position, 1);
+
+        glBindVertexArray(previous_vao);
+    }
 
     this->calculate_dimensions();
 }
@@ -68,6 +105,14 @@ void TextLayer::update() {
     this->calculate_attribute_buffers();
 }
 
+void TextLayer::set_render_mode(TextRenderMode mode) {
+    this->render_mode = mode;
+}
+
+TextRenderMode TextLayer::get_render_mode() {
+    return this->render_mode;
+}
+
 void TextLayer::set_font(string font_path, int font_height) {
     this->font_path = font_path;
     this->font_height = font_height;
@@ -77,6 +122,34 @@ void TextLayer::set_font(string font_path, int font_height) {
 
 void TextLayer::bind_text_buffer(TextBuffer* buffer) {
     this->buffer = buffer;
+
+    this->buffer->register_change_callback([this](const BufferChange &change) {
+        this->handle_buffer_change(change);
+    });
+}
+
+void TextLayer::bind_search(BufferSearch *search) {
+    this->search = search;
+}
+
+void TextLayer::refresh_lines() {
+    this->lines_dirty = true;
+}
+
+void TextLayer::handle_buffer_change(const BufferChange &change) {
+    size_t first_visible = this->start_line;
+    size_t last_visible = this->start_line + this->rows;
+
+    // Lines after the change only move if it added or removed some
+    size_t last_changed = change.first_line + change.inserted_lines;
+
+    if (change.inserted_lines != change.removed_lines) {
+        last_changed = SIZE_MAX;
+    }
+
+    if (change.first_line < last_visible && last_changed >= first_visible) {
+        this->lines_dirty = true;
+    }
 }
 
 bool TextLayer::rasterize_font() {
@@ -105,15 +178,30 @@ bool TextLayer::rasterize_font() {
     unsigned char *bitmap_data;
     Glyph glyph;
 
-    unsigned int current_width = 0;
+    // Rows are as tall as the tallest glyph, which for box drawing and the
+    // like is a good bit more than the font height
+    int row_height = this->font_height;
     atlas_width = 512;
     atlas_height = 0;
 
     // Clear existing glyphs
     glyphs.clear();
 
-    // Load ASCII charset
-    for (unsigned char c = 0; c < 128; ++c) {
+    std::vector<char32_t> charset;
+
+    for (const auto &[first, last] : glyph_ranges) {
+        for (char32_t c = first; c <= last; ++c) {
+            charset.push_back(c);
+        }
+    }
+
+    for (char32_t c : charset) {
+        // Control characters are never drawn, and anything the font lacks
+        // is left for the fallbacks in `find_glyph`
+        if (c >= 0x80 && !FT_Get_Char_Index(face, c)) {
+            continue;
+        }
+
         if (FT_Load_Char(face, c, FT_LOAD_RENDER)) {
             PLOGE << "Failed to load glyph #" << static_cast<unsigned int>(c);
             continue;
@@ -150,17 +238,30 @@ bool TextLayer::rasterize_font() {
             };
         }
 
-        glyphs.insert(std::pair<char, Glyph>(c, glyph));
+        glyphs.insert(std::pair<char32_t, Glyph>(c, glyph));
 
-        current_width += glyph.size.x;
+        row_height = std::max(row_height, glyph.size.y);
+    }
 
-        if (current_width > atlas_width) {
-            current_width = glyph.size.x;
-            atlas_height += this->font_height;
+    // Lay the glyphs out first, in the same order they're written to the
+    // atlas in, so it's made exactly as tall as that needs
+    int x = 0;
+    int y = 0;
+    for (auto &[key, glyph] : glyphs) {
+        if (!glyph.data) {
+            continue;
+        }
+
+        if (x + glyph.size.x > int(atlas_width)) {
+            x = 0;
+            y += row_height;
         }
+
+        glyph.atlas_position = glm::ivec2(x, y);
+        x += glyph.size.x;
     }
 
-    atlas_height += this->font_height;
+    atlas_height = y + row_height;
 
     PLOGI << "Atlas width: " << atlas_width << "px, height: " << atlas_height << "px";
 
@@ -185,14 +286,7 @@ bool TextLayer::rasterize_font() {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
     // Populate atlas
-    int x = 0;
-    int y = 0;
     for (auto const& [key, glyph] : glyphs) {
-        if (x + glyph.size.x > atlas_width) {
-            x = 0;
-            y += this->font_height;
-        }
-
         if (!glyph.data) {
             continue;
         }
@@ -201,8 +295,8 @@ bool TextLayer::rasterize_font() {
         glTexSubImage2D(
             GL_TEXTURE_2D,
             0,
-            x,
-            y,
+            glyph.atlas_position.x,
+            glyph.atlas_position.y,
             glyph.size.x,
             glyph.size.y,
             GL_RED,
@@ -210,26 +304,57 @@ bool TextLayer::rasterize_font() {
             glyph.data
         );
 
-        // Calculate the character's UV position in the atlas
-        float uv_x1 = float(x) / atlas_width;
-        float uv_y1 = float(y) / atlas_height;
-        float uv_x2 = float(x + glyph.size.x) / atlas_width;
-        float uv_y2 = float(y + glyph.size.y) / atlas_height;
-
-        glyphs[key].uv_start = glm::vec2(uv_x1, uv_y1);
-        glyphs[key].uv_stop = glm::vec2(uv_x2, uv_y2);
-
         PLOGD
             << "Character #" << static_cast<unsigned int>(key)
-            << ": UV1 (" << uv_x1 << ", " << uv_y1 << ")"
-            << ", UV2 (" << uv_x2 << ", " << uv_y2 << ")";
+            << ": atlas position (" << glyph.atlas_position.x << ", " << glyph.atlas_position.y << ")";
 
         // We don't need the bitmap data anymore now that it's in a texture atlas
         free(glyph.data);
+    }
 
-        x += glyph.size.x;
+    // The shader looks glyphs up by index, two texels each: the bearing and
+    // size, then the corners of the glyph in the atlas. It's all in whole
+    // pixels, so 16 bit integers are plenty (textures can't be any bigger),
+    // and the shader normalizes the atlas coordinates itself.
+    std::vector<GLshort> metrics;
+    metrics.reserve(8 * glyphs.size());
+    GLushort id = 0;
+
+    for (auto &[key, glyph] : glyphs) {
+        glyph.id = id++;
+
+        if (glyph.size.x == 0 || glyph.size.y == 0) {
+            metrics.insert(metrics.end(), 8, 0);
+            continue;
+        }
+
+        metrics.insert(metrics.end(), {
+            static_cast<GLshort>(glyph.bearing.x),
+            static_cast<GLshort>(glyph.bearing.y),
+            static_cast<GLshort>(glyph.size.x),
+            static_cast<GLshort>(glyph.size.y),
+            static_cast<GLshort>(glyph.atlas_position.x),
+            static_cast<GLshort>(glyph.atlas_position.y),
+            static_cast<GLshort>(glyph.atlas_position.x + glyph.size.x),
+            static_cast<GLshort>(glyph.atlas_position.y + glyph.size.y)
+        });
+    }
+
+    for (char32_t c = 0; c < 0x80; ++c) {
+        ascii_glyph_ids[c] = find_glyph(c).id;
     }
 
+    if (!this->glyph_metrics_buffer) {
+        glGenBuffers(1, &this->glyph_metrics_buffer);
+        glGenTextures(1, &this->glyph_metrics_texture_id);
+    }
+
+    glBindBuffer(GL_TEXTURE_BUFFER, this->glyph_metrics_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, metrics.size() * sizeof(GLshort), metrics.data(), GL_STATIC_DRAW);
+
+    glBindTexture(GL_TEXTURE_BUFFER, this->glyph_metrics_texture_id);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA16I, this->glyph_metrics_buffer);
+
     // Discard freetype objects
     FT_Done_Face(face);
     FT_Done_FreeType(ft);
@@ -238,12 +363,13 @@ bool TextLayer::rasterize_font() {
 }
 
 void TextLayer::teardown() {
-    glDeleteBuffers(1, &this->vbo_vertices);
-    glDeleteBuffers(1, &this->vbo_uvs);
-    glDeleteBuffers(1, &this->vbo_colors);
-    glDeleteBuffers(1, &this->ibo_faces);
+    glDeleteVertexArrays(1, &this->vao);
+    glDeleteBuffers(1, &this->vbo_instances);
+    glDeleteBuffers(1, &this->glyph_metrics_buffer);
 
     glDeleteTextures(1, &this->atlas_texture_id);
+    glDeleteTextures(1, &this->glyph_metrics_texture_id);
+    glDeleteTextures(1, &this->grid_texture_id);
 }
 
 void TextLayer::set_text(string text) {
@@ -262,60 +388,51 @@ void TextLayer::set_position(float x, float y) {
 }
 
 void TextLayer::calculate_dimensions() {
+    unsigned int columns = 80;
+    unsigned int rows = 24;
+
     if (glyphs.contains(' ')) {
         float space_advance = glyphs[' '].advance / 64.0f;
-        this->columns = ceil(1.0f * Window::width / space_advance);
-        this->rows = ceil(1.0f * Window::height / this->font_height);
-        PLOGD << "C: " << this->columns << " R: " << this->rows;
-    } else {
-        this->columns = 80;
-        this->rows = 24;
+        columns = ceil(1.0f * Window::width / space_advance);
+        rows = ceil(1.0f * Window::height / this->font_height);
     }
 
+    // This runs on every update, but the buffers only need touching when
+    // the window or font has changed size
+    if (columns == this->columns && rows == this->rows && this->dirty_rows.size() == rows) {
+        return;
+    }
+
+    this->columns = columns;
+    this->rows = rows;
+    PLOGD << "C: " << this->columns << " R: " << this->rows;
+
     this->char_count = this->columns * this->rows;
     this->allocate_attribute_buffers();
 }
 
 void TextLayer::allocate_attribute_buffers() {
-    this->vertices = (float*) realloc(this->vertices, 2 * sizeof(float) * 4 * this->char_count);
-    if (this->vertices == nullptr) {
-        PLOGF << "Failed to allocate memory for vertices";
-        return;
-    }
-
-    this->uvs = (float*) realloc(this->uvs, 2 * sizeof(float) * 4 * this->char_count);
-    if (this->uvs == nullptr) {
-        PLOGF << "Failed to allocate memory for UVs";
-        return;
-    }
+    // Whatever was laid out before doesn't fit the new grid
+    this->dirty_rows.assign(this->rows, true);
+    this->lines_dirty = true;
+
+    if (this->render_mode == GridRender) {
+        this->grid_cells = (GridCell*) realloc(this->grid_cells, sizeof(GridCell) * this->char_count);
+        if (this->grid_cells == nullptr) {
+            PLOGF << "Failed to allocate memory for grid cells";
+        }
 
-    this->colors = (float*) realloc(this->colors, 4 * sizeof(float) * 4 * this->char_count);
-    if (this->colors == nullptr) {
-        PLOGF << "Failed to allocate memory for colors";
         return;
     }
 
-    this->faces = (GLushort*) realloc(this->faces, sizeof(GLushort) * 6 * this->char_count);
-    if (this->faces == nullptr) {
-        PLOGF << "Failed to allocate memory for faces";
+    this->instances = (CellInstance*) realloc(this->instances, sizeof(CellInstance) * this->char_count);
+    if (this->instances == nullptr) {
+        PLOGF << "Failed to allocate memory for cell instances";
         return;
     }
-
-    for (unsigned int i = 0; i < this->char_count; ++i) {
-        // Face 1
-        this->faces[6 * i    ] = 4 * (i + 1) - 4;
-        this->faces[6 * i + 1] = 4 * (i + 1) - 3;
-        this->faces[6 * i + 2] = 4 * (i + 1) - 2;
-
-        // Face 2
-        this->faces[6 * i + 3] = 4 * (i + 1) - 4;
-        this->faces[6 * i + 4] = 4 * (i + 1) - 2;
-        this->faces[6 * i + 5] = 4 * (i + 1) - 1;
-    }
 }
 
 void TextLayer::set_start_line(unsigned int line_num) {
-    this->last_start_line = this->start_line;
     this->start_line = line_num;
 }
 
@@ -323,248 +440,363 @@ unsigned int TextLayer::get_start_line() {
     return this->start_line;
 }
 
-void TextLayer::calculate_attribute_buffers() {
-    this->calculate_dimensions();
+unsigned int TextLayer::get_rows() {
+    return this->rows;
+}
 
-    float bearing_x, bearing_y, width, height, advance, x_pos, y_pos;
-    float to_screen_width = 2.0f / Window::width;
-    float to_screen_height = 2.0f / Window::height;
-    float space_advance = glyphs[' '].advance / 64.0f * to_screen_width;
-    float font_height = this->font_height * to_screen_height;
+unsigned int TextLayer::ring_slot(int row) {
+    int slot = row % static_cast<int>(this->rows);
+    return slot < 0 ? slot + this->rows : slot;
+}
 
-    // Set up all the VBOs
+void TextLayer::layout_rows(unsigned int first_line, int first_row, unsigned int count) {
+    this->buffer->seek_line(first_line);
 
-    this->buffer->seek_line(this->start_line);
+    // Matches come back sorted by line, so each row's are the next few
+    if (this->search) {
+        this->search->matches_in_lines(first_line, count, this->row_matches);
+    } else {
+        this->row_matches.clear();
+    }
 
-    int line_diff = this->start_line - this->last_start_line;
+    auto next_match = this->row_matches.begin();
 
-    if (line_diff > 0) {
-        // We've shifted down in the document by `line_diff` lines.
-        // Visually, the document is moving upwards by `line_diff` lines.
-        // We can replace the top-most `line_diff` lines in memory.
+    for (unsigned int i = 0; i < count; ++i) {
+        auto first_match = next_match;
 
-        // Here's an example shift down by 2 lines:
-        // Memory before: a b c d e
-        // Memory after:  f g c d e
-
-        unsigned int lines_replaced = 0;
-        std::optional<string> line;
-        char c;
-
-        while ((line = this->buffer->read_next_line()).has_value() && lines_replaced < line_diff) {
-            PLOGD << "Got line: \"" << *line << "\"";
-            float last_x = -1.0f;
-
-            for (unsigned int column = 0; column < this->columns;) {
-                if (column < line->length()) {
-                    c = (*line)[column];
-                } else {
-                    // This is our clear character
-                    c = ' ';
-                }
-
-                Glyph glyph = glyphs[c];
-                unsigned int idx = (this->top_line_idx * this->columns + column) * 4;
-
-                // Handle geometry correctly for whitespace characters
-                if (c == '\r') {
-                    last_x = -1.0f;
-                    column = 0;
-                    continue;
-                } else if (c == '\t') {
-                    last_x += 4.0f * space_advance;
-                    column += 4;
-                    continue;
-                }
-
-                if (column < columns) {
-                    advance = glyph.advance / 64.0f * to_screen_width;
-                    bearing_x = float(glyph.bearing.x) * to_screen_width;
-                    bearing_y = float(glyph.bearing.y) * to_screen_height;
-                    width = float(glyph.size.x) * to_screen_width;
-                    height = float(glyph.size.y) * to_screen_height;
-
-                    x_pos = last_x + bearing_x;
-                    y_pos = last_y + bearing_y - font_height;
-
-                    VEC2(vertices, idx + 0, x_pos,         y_pos - height)
-                    VEC2(vertices, idx + 1, x_pos,         y_pos)
-                    VEC2(vertices, idx + 2, x_pos + width, y_pos)
-                    VEC2(vertices, idx + 3, x_pos + width, y_pos - height)
-
-                    VEC2(uvs, idx + 0, glyph.uv_start.x, glyph.uv_stop.y)
-                    VEC2(uvs, idx + 1, glyph.uv_start.x, glyph.uv_start.y)
-                    VEC2(uvs, idx + 2, glyph.uv_stop.x,  glyph.uv_start.y)
-                    VEC2(uvs, idx + 3, glyph.uv_stop.x,  glyph.uv_stop.y)
-
-                    VEC4(colors, idx + 0, 1.0f, 1.0f, 1.0f, 1.0f)
-                    VEC4(colors, idx + 1, 1.0f, 1.0f, 1.0f, 1.0f)
-                    VEC4(colors, idx + 2, 1.0f, 1.0f, 1.0f, 1.0f)
-                    VEC4(colors, idx + 3, 1.0f, 1.0f, 1.0f, 1.0f)
-
-                    last_x += advance;
-                    column++;
-                }
+        while (next_match != this->row_matches.end() && next_match->line == first_line + i) {
+            next_match++;
+        }
+
+        // Rows past the end of the document are left blank
+        std::optional<std::string_view> line = this->buffer->read_next_line_view();
+        this->layout_row(line.value_or(std::string_view()), first_row + i, {first_match, next_match});
+    }
+}
+
+void TextLayer::layout_row(std::string_view line, int row_number, std::span<const SearchMatch> matches) {
+    // Lines are laid out by codepoint, not by byte. Most lines are pure
+    // ASCII though, where the two are the same and there's nothing to decode.
+    bool ascii = is_ascii(line.data(), line.size());
+    size_t length = line.size();
+
+    if (!ascii) {
+        decode_utf8(line.data(), line.size(), this->codepoints);
+        length = this->codepoints.size();
+    }
+
+    // Matches are in bytes, so they're converted to codepoints as well. They
+    // might be from before the line was last edited, so they're clamped to it.
+    this->match_ranges.clear();
+
+    for (const SearchMatch &match : matches) {
+        size_t column = std::min(match.column, line.size());
+        size_t count = std::min(match.length, line.size() - column);
+
+        if (ascii) {
+            this->match_ranges.emplace_back(column, column + count);
+        } else {
+            size_t start = count_codepoints(line.data(), column);
+            this->match_ranges.emplace_back(start, start + count_codepoints(line.data() + column, count));
+        }
+    }
+
+    auto range = this->match_ranges.begin();
+
+    unsigned int slot = this->ring_slot(row_number);
+    bool grid = this->render_mode == GridRender;
+
+    // Only the active mode's storage exists, the other one is null
+    CellInstance *cells = grid ? nullptr : this->instances + slot * this->columns;
+    GridCell *grid_cells = grid ? this->grid_cells + slot * this->columns : nullptr;
+    GLushort row = static_cast<GLushort>(row_number);
+    GLushort blank = find_glyph_id(' ');
+    unsigned int column = 0;
+
+    auto put = [&](GLushort glyph, GLushort style) {
+        if (grid) {
+            grid_cells[column] = {glyph, style};
+        } else {
+            cells[column] = {static_cast<GLushort>(column), row, glyph, style};
+        }
+
+        column++;
+    };
+
+    for (size_t i = 0; i < length; ++i) {
+        char32_t c = ascii ? static_cast<unsigned char>(line[i]) : this->codepoints[i];
+
+        if (column >= this->columns) {
+            break;
+        }
+
+        while (range != this->match_ranges.end() && range->second <= i) {
+            range++;
+        }
+
+        GLushort style = range != this->match_ranges.end() && range->first <= i ? MatchStyle : DefaultStyle;
+
+        // Line views never contain their terminators, so tabs are the only
+        // whitespace needing special handling
+        if (c == '\t') {
+            unsigned int tab_stop = std::min(column + 4, this->columns);
+
+            while (column < tab_stop) {
+                put(blank, style);
             }
 
-            lines_replaced++;
-            this->vertical_char_offset++;
-            this->last_y -= font_height;
-            this->top_line_idx++;
-            this->top_line_idx %= this->rows;
+            continue;
         }
+
+        put(find_glyph_id(c), style);
+    }
+
+    // Whatever's left of the row gets cleared
+    while (column < this->columns) {
+        put(blank, DefaultStyle);
+    }
+
+    this->dirty_rows[slot] = true;
+}
+
+void TextLayer::calculate_attribute_buffers() {
+    this->calculate_dimensions();
+
+    auto layout_start = std::chrono::high_resolution_clock::now();
+    int line_diff = this->start_line - this->last_start_line;
+    unsigned int lines_replaced = 0;
+
+    if (this->lines_dirty || std::abs(line_diff) >= static_cast<int>(this->rows)) {
+        // Nothing on screen can be kept (or there's no telling which lines
+        // changed), so every row gets laid out again
+        this->lines_dirty = false;
+        lines_replaced = this->rows;
+        this->layout_rows(this->start_line, this->vertical_char_offset, this->rows);
+    } else if (line_diff > 0) {
+        // We've shifted down in the document by `line_diff` lines.
+        // Visually, the document is moving upwards by `line_diff` lines.
+        // The top-most `line_diff` rows have scrolled off, so their slots
+        // become the new rows at the bottom.
+
+        // Here's an example shift down by 2 lines:
+        // Memory before: a b c d e (a on top)
+        // Memory after:  f g c d e (c on top)
+
+        lines_replaced = line_diff;
+        this->layout_rows(
+            this->start_line + this->rows - lines_replaced,
+            this->vertical_char_offset + this->rows,
+            lines_replaced
+        );
+        this->vertical_char_offset += lines_replaced;
     } else if (line_diff < 0) {
-        // BUG: This doesn't work. Like, at all.
- 
         // We've shifted up in the document by `line_diff` lines.
-        // Same situation as above, but reversed.
+        // Same situation as above, but reversed: the bottom-most
+        // rows scroll off and become the new rows at the top.
 
         // Here's an example shift up by 2 lines:
-        // Memory before: c d e f g
-        // Memory after:  c d e a b
-
-        unsigned int lines_replaced = 0;
-        std::optional<string> line;
-        char c;
-
-        while ((line = this->buffer->read_next_line()).has_value() && lines_replaced < line_diff) {
-            PLOGD << "Got line: \"" << *line << "\"";
-            float last_x = -1.0f;
-
-            for (unsigned int column = 0; column < this->columns;) {
-                if (column < line->length()) {
-                    c = (*line)[column];
-                } else {
-                    // This is our clear character
-                    c = ' ';
-                }
-
-                Glyph glyph = glyphs[c];
-                unsigned int idx = (this->bottom_line_idx * this->columns + column) * 4;
-
-                // Handle geometry correctly for whitespace characters
-                if (c == '\r') {
-                    last_x = -1.0f;
-                    column = 0;
-                    continue;
-                } else if (c == '\t') {
-                    last_x += 4.0f * space_advance;
-                    column += 4;
-                    continue;
-                }
-
-                if (column < columns) {
-                    advance = glyph.advance / 64.0f * to_screen_width;
-                    bearing_x = float(glyph.bearing.x) * to_screen_width;
-                    bearing_y = float(glyph.bearing.y) * to_screen_height;
-                    width = float(glyph.size.x) * to_screen_width;
-                    height = float(glyph.size.y) * to_screen_height;
-
-                    x_pos = last_x + bearing_x;
-                    y_pos = last_y + bearing_y - font_height;
-
-                    VEC2(vertices, idx + 0, x_pos,         y_pos - height)
-                    VEC2(vertices, idx + 1, x_pos,         y_pos)
-                    VEC2(vertices, idx + 2, x_pos + width, y_pos)
-                    VEC2(vertices, idx + 3, x_pos + width, y_pos - height)
-
-                    VEC2(uvs, idx + 0, glyph.uv_start.x, glyph.uv_stop.y)
-                    VEC2(uvs, idx + 1, glyph.uv_start.x, glyph.uv_start.y)
-                    VEC2(uvs, idx + 2, glyph.uv_stop.x,  glyph.uv_start.y)
-                    VEC2(uvs, idx + 3, glyph.uv_stop.x,  glyph.uv_stop.y)
-
-                    VEC4(colors, idx + 0, 1.0f, 1.0f, 1.0f, 1.0f)
-                    VEC4(colors, idx + 1, 1.0f, 1.0f, 1.0f, 1.0f)
-                    VEC4(colors, idx + 2, 1.0f, 1.0f, 1.0f, 1.0f)
-                    VEC4(colors, idx + 3, 1.0f, 1.0f, 1.0f, 1.0f)
-
-                    last_x += advance;
-                    column++;
-                }
-            }
+        // Memory before: c d e f g (c on top)
+        // Memory after:  c d e a b (a on top)
 
-            lines_replaced++;
-            this->vertical_char_offset++;
-            this->last_y -= font_height;
-            this->bottom_line_idx = this->bottom_line_idx ? this->bottom_line_idx - 1 : this->rows - 1;
-        }
-    } else {
-        // We don't need to do anything and
-        // this case probably shouldn't occur.
+        lines_replaced = -line_diff;
+        this->vertical_char_offset -= lines_replaced;
+        this->layout_rows(this->start_line, this->vertical_char_offset, lines_replaced);
+    }
+
+    this->last_start_line = this->start_line;
+
+    if (lines_replaced) {
+        std::chrono::duration<float, std::micro> layout_duration =
+            std::chrono::high_resolution_clock::now() - layout_start;
+        PLOGD << "Laid out " << lines_replaced << " rows in " << layout_duration.count() << "us";
     }
 
     // Populate buffers
 
-    glBindBuffer(GL_ARRAY_BUFFER, this->vbo_vertices);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        4 * 2 * this->char_count * sizeof(float),
-        this->vertices,
-        GL_STATIC_DRAW
-    );
+    if (this->render_mode == GridRender) {
+        this->upload_grid();
+    } else {
+        this->upload_instances();
+    }
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, this->vbo_uvs);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        4 * 2 * this->char_count * sizeof(float),
-        this->uvs,
-        GL_STATIC_DRAW
-    );
+// Calls `upload(first, count)` for each run of dirty rows, and marks them
+// clean again. A scroll only dirties the rows it laid out, and those sit
+// next to each other in the ring (or wrap around it, making two runs).
+template <typename Upload>
+static void upload_dirty_rows(std::vector<bool> &dirty_rows, Upload upload) {
+    size_t row = 0;
 
-    glBindBuffer(GL_ARRAY_BUFFER, this->vbo_colors);
-    glBufferData(
-        GL_ARRAY_BUFFER,
-        4 * 4 * this->char_count * sizeof(float),
-        this->colors,
-        GL_STATIC_DRAW
-    );
+    while (row < dirty_rows.size()) {
+        if (!dirty_rows[row]) {
+            row++;
+            continue;
+        }
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->ibo_faces);
-    glBufferData(
-        GL_ELEMENT_ARRAY_BUFFER,
-        6 * this->char_count * sizeof(GLushort),
-        this->faces,
-        GL_STATIC_DRAW
-    );
+        size_t first = row;
+
+        while (row < dirty_rows.size() && dirty_rows[row]) {
+            dirty_rows[row] = false;
+            row++;
+        }
+
+        upload(first, row - first);
+    }
+}
+
+void TextLayer::upload_instances() {
+    glBindBuffer(GL_ARRAY_BUFFER, this->vbo_instances);
+
+    // The buffer is only reallocated when the grid changes size. The rest of
+    // the time only the rows that were laid out again go up.
+    if (this->uploaded_columns != this->columns || this->uploaded_rows != this->rows) {
+        this->uploaded_columns = this->columns;
+        this->uploaded_rows = this->rows;
+
+        glBufferData(
+            GL_ARRAY_BUFFER,
+            this->char_count * sizeof(CellInstance),
+            this->instances,
+            GL_DYNAMIC_DRAW
+        );
+
+        std::fill(this->dirty_rows.begin(), this->dirty_rows.end(), false);
+        return;
+    }
+
+    upload_dirty_rows(this->dirty_rows, [this](size_t first, size_t count) {
+        glBufferSubData(
+            GL_ARRAY_BUFFER,
+            first * this->columns * sizeof(CellInstance),
+            count * this->columns * sizeof(CellInstance),
+            this->instances + first * this->columns
+        );
+    });
+}
+
+void TextLayer::upload_grid() {
+    glBindTexture(GL_TEXTURE_2D, this->grid_texture_id);
+
+    // Same as the instances, the texture only needs remaking when the grid
+    // changes size
+    if (this->uploaded_columns != this->columns || this->uploaded_rows != this->rows) {
+        this->uploaded_columns = this->columns;
+        this->uploaded_rows = this->rows;
+
+        glTexImage2D(
+            GL_TEXTURE_2D,
+            0,
+            GL_RG16UI,
+            this->columns,
+            this->rows,
+            0,
+            GL_RG_INTEGER,
+            GL_UNSIGNED_SHORT,
+            this->grid_cells
+        );
+
+        // Integer textures can't be filtered
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        std::fill(this->dirty_rows.begin(), this->dirty_rows.end(), false);
+        return;
+    }
+
+    upload_dirty_rows(this->dirty_rows, [this](size_t first, size_t count) {
+        glTexSubImage2D(
+            GL_TEXTURE_2D,
+            0,
+            0,
+            first,
+            this->columns,
+            count,
+            GL_RG_INTEGER,
+            GL_UNSIGNED_SHORT,
+            this->grid_cells + first * this->columns
+        );
+    });
 }
 
 void TextLayer::draw() {
-    float to_screen_height = 2.0f / Window::height;
-    float font_height = this->font_height * to_screen_height;
-    glm::vec3 translation(
-        0.0f,
-        font_height * (this->vertical_char_offset - this->rows),
-        0.0f
-    );
-    glm::mat4 model = glm::translate(glm::mat4(1.0f), translation);
+    if (this->render_mode == GridRender) {
+        this->draw_grid();
+    } else {
+        this->draw_instanced();
+    }
+}
 
-    GLuint model_location = glGetUniformLocation(this->shader_id, "model");
-    glUniformMatrix4fv(model_location, 1, GL_FALSE, glm::value_ptr(model));
+void TextLayer::draw_instanced() {
+    // Instances only know which row of the ring they were laid out in, so
+    // they're positioned relative to the row at the top of the screen. Row
+    // numbers wrap around, which is fine as long as the difference does too.
+    // Scrolling only ever has to move this.
+    GLuint first_row = static_cast<GLushort>(this->vertical_char_offset);
+    glUniform1ui(glGetUniformLocation(this->shader_id, "first_row"), first_row);
+
+    glUniform2f(glGetUniformLocation(this->shader_id, "screen_size"), Window::width, Window::height);
+    glUniform2f(
+        glGetUniformLocation(this->shader_id, "cell_size"),
+        find_glyph(' ').advance / 64.0f,
+        this->font_height
+    );
+    glUniform4fv(
+        glGetUniformLocation(this->shader_id, "style_colors"),
+        StyleCount,
+        &style_colors[0].x
+    );
 
     GLuint texture_location = glGetUniformLocation(this->shader_id, "atlas");
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, this->atlas_texture_id);
     glUniform1i(texture_location, 0);
 
-    GLint vertex_position = glGetAttribLocation(this->shader_id, "vertex");
-    glEnableVertexAttribArray(vertex_position);
-    glBindBuffer(GL_ARRAY_BUFFER, this->vbo_vertices);
-    glVertexAttribPointer(vertex_position, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    GLuint metrics_location = glGetUniformLocation(this->shader_id, "glyph_metrics");
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, this->glyph_metrics_texture_id);
+    glUniform1i(metrics_location, 1);
 
-    GLint uv_position = glGetAttribLocation(this->shader_id, "tex_coord");
-    glEnableVertexAttribArray(uv_position);
-    glBindBuffer(GL_ARRAY_BUFFER, this->vbo_uvs);
-    glVertexAttribPointer(uv_position, 2, GL_FLOAT, GL_FALSE, 0, 0);
+    // One instance per cell, each expanded into a quad by the vertex shader
+    GLint previous_vao;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous_vao);
+    glBindVertexArray(this->vao);
 
-    GLint color_position = glGetAttribLocation(this->shader_id, "color");
-    glEnableVertexAttribArray(color_position);
-    glBindBuffer(GL_ARRAY_BUFFER, this->vbo_colors);
-    glVertexAttribPointer(color_position, 4, GL_FLOAT, GL_FALSE, 0, 0);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, this->char_count);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->ibo_faces);
-    glDrawElements(GL_TRIANGLES, 6 * char_count, GL_UNSIGNED_SHORT, 0);
+    glBindVertexArray(previous_vao);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+void TextLayer::draw_grid() {
+    // Rows of the grid texture are a ring, the same as the instances are
+    glUniform1i(glGetUniformLocation(this->shader_id, "top_row"), this->ring_slot(this->vertical_char_offset));
+
+    glUniform2f(glGetUniformLocation(this->shader_id, "screen_size"), Window::width, Window::height);
+    glUniform2f(
+        glGetUniformLocation(this->shader_id, "cell_size"),
+        find_glyph(' ').advance / 64.0f,
+        this->font_height
+    );
+    glUniform4fv(
+        glGetUniformLocation(this->shader_id, "style_colors"),
+        StyleCount,
+        &style_colors[0].x
+    );
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, this->atlas_texture_id);
+    glUniform1i(glGetUniformLocation(this->shader_id, "atlas"), 0);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, this->glyph_metrics_texture_id);
+    glUniform1i(glGetUniformLocation(this->shader_id, "glyph_metrics"), 1);
 
-    glDisableVertexAttribArray(vertex_position);
-    glDisableVertexAttribArray(uv_position);
-    glDisableVertexAttribArray(color_position);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, this->grid_texture_id);
+    glUniform1i(glGetUniformLocation(this->shader_id, "cells"), 2);
+
+    // A single triangle big enough to cover the screen
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glActiveTexture(GL_TEXTURE0);
 }
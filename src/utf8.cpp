@@ -0,0 +1,443 @@
+#include "vigor/simd.h"
+#include "vigor/utf8.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Decodes the sequence at the start of `data` into `cp`, returning its length
+// in bytes, or 0 if it isn't valid
+static size_t decode_one(const unsigned char *data, size_t length, char32_t &cp) {
+    unsigned char lead = data[0];
+    size_t len;
+    char32_t min;
+
+    if (lead < 0x80) {
+        cp = lead;
+        return 1;
+    } else if ((lead & 0xE0) == 0xC0) {
+        len = 2;
+        min = 0x80;
+        cp = lead & 0x1F;
+    } else if ((lead & 0xF0) == 0xE0) {
+        len = 3;
+        min = 0x800;
+        cp = lead & 0x0F;
+    } else if ((lead & 0xF8) == 0xF0) {
+        len = 4;
+        min = 0x10000;
+        cp = lead & 0x07;
+    } else {
+        return 0;
+    }
+
+    if (length < len) {
+        return 0;
+    }
+
+    for (size_t i = 1; i < len; ++i) {
+        if ((data[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+
+        cp = (cp << 6) | (data[i] & 0x3F);
+    }
+
+    // Overlong encodings, surrogates and anything past the last plane
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return 0;
+    }
+
+    return len;
+}
+
+static bool is_ascii_scalar(const unsigned char *data, size_t length) {
+    unsigned char bits = 0;
+
+    for (size_t i = 0; i < length; ++i) {
+        bits |= data[i];
+    }
+
+    return bits < 0x80;
+}
+
+static bool validate_utf8_scalar(const unsigned char *data, size_t length) {
+    char32_t cp;
+
+    for (size_t i = 0; i < length;) {
+        size_t len = decode_one(data + i, length - i, cp);
+
+        if (len == 0) {
+            return false;
+        }
+
+        i += len;
+    }
+
+    return true;
+}
+
+// The `widen_ascii_*` functions copy the ASCII bytes at the start of `data`
+// out as codepoints, and return how many they got through. They may stop
+// short of the first non-ASCII byte, but never go past it.
+
+static size_t widen_ascii_scalar(const unsigned char *data, size_t length, char32_t *out) {
+    size_t i = 0;
+
+    for (; i < length && data[i] < 0x80; ++i) {
+        out[i] = data[i];
+    }
+
+    return i;
+}
+
+#ifdef VIGOR_X86
+
+static bool is_ascii_sse2(const unsigned char *data, size_t length) {
+    __m128i bits = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        bits = _mm_or_si128(bits, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+    }
+
+    return _mm_movemask_epi8(bits) == 0 && is_ascii_scalar(data + i, length - i);
+}
+
+VIGOR_TARGET_AVX2
+static bool is_ascii_avx2(const unsigned char *data, size_t length) {
+    __m256i bits = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        bits = _mm256_or_si256(bits, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i)));
+    }
+
+    return _mm256_movemask_epi8(bits) == 0 && is_ascii_scalar(data + i, length - i);
+}
+
+static size_t widen_ascii_sse2(const unsigned char *data, size_t length, char32_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        unsigned int mask = _mm_movemask_epi8(chunk);
+
+        if (mask) {
+            return i + widen_ascii_scalar(data + i, VIGOR_CTZ(mask), out + i);
+        }
+
+        // Zero extend each byte to 32 bits
+        __m128i lo = _mm_unpacklo_epi8(chunk, zero);
+        __m128i hi = _mm_unpackhi_epi8(chunk, zero);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+
+    return i + widen_ascii_scalar(data + i, length - i, out + i);
+}
+
+VIGOR_TARGET_AVX2
+static size_t widen_ascii_avx2(const unsigned char *data, size_t length, char32_t *out) {
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned int mask = _mm256_movemask_epi8(chunk);
+
+        if (mask) {
+            return i + widen_ascii_scalar(data + i, VIGOR_CTZ(mask), out + i);
+        }
+
+        __m128i lo = _mm256_castsi256_si128(chunk);
+        __m128i hi = _mm256_extracti128_si256(chunk, 1);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_cvtepu8_epi32(lo));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 16), _mm256_cvtepu8_epi32(hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+    }
+
+    return i + widen_ascii_scalar(data + i, length - i, out + i);
+}
+
+// Validation follows "Validating UTF-8 In Less Than One Instruction Per Byte"
+// (Keiser and Lemire). Every error that involves just two neighbouring bytes
+// is found with three table lookups, one on each nibble of the previous byte
+// and one on the high nibble of the current byte, and'd together. Each bit in
+// the tables stands for one kind of error. The only thing left after that is
+// making sure the third and fourth bytes of long sequences are continuations.
+
+static const uint8_t too_short = 1 << 0;      // 11______ 0_______, 11______ 11______
+static const uint8_t too_long = 1 << 1;       // 0_______ 10______
+static const uint8_t overlong_3 = 1 << 2;     // 11100000 100_____
+static const uint8_t too_large = 1 << 3;      // 11110100 1001____, 11110100 101_____, 11110101+ 1_______
+static const uint8_t surrogate = 1 << 4;      // 11101101 101_____
+static const uint8_t overlong_2 = 1 << 5;     // 1100000_ 10______
+static const uint8_t too_large_1000 = 1 << 6; // 11110101+ 1000____
+static const uint8_t overlong_4 = 1 << 6;     // 11110000 1000____
+static const uint8_t two_conts = 1 << 7;      // 10______ 10______
+static const uint8_t carry = too_short | too_long | two_conts;
+
+#define VIGOR_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+VIGOR_TARGET_AVX2
+static inline __m256i high_nibbles(__m256i bytes) {
+    return _mm256_and_si256(_mm256_srli_epi16(bytes, 4), _mm256_set1_epi8(0x0F));
+}
+
+// The bytes just before each byte of `input`, `n` back, continuing on from
+// `prev_input`
+#define VIGOR_PREV(input, prev_input, n) \
+    _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev_input, input, 0x21), 16 - (n))
+
+VIGOR_TARGET_AVX2
+static inline __m256i check_utf8_block(__m256i input, __m256i prev_input) {
+    const __m256i byte_1_high_table = VIGOR_TABLE(
+        // 0_______ ________
+        too_long, too_long, too_long, too_long,
+        too_long, too_long, too_long, too_long,
+        // 10______ ________
+        two_conts, two_conts, two_conts, two_conts,
+        // 1100____ ________
+        too_short | overlong_2,
+        // 1101____ ________
+        too_short,
+        // 1110____ ________
+        too_short | overlong_3 | surrogate,
+        // 1111____ ________
+        too_short | too_large | too_large_1000 | overlong_4);
+
+    const __m256i byte_1_low_table = VIGOR_TABLE(
+        // ____0000 ________
+        carry | overlong_3 | overlong_2 | overlong_4,
+        // ____0001 ________
+        carry | overlong_2,
+        // ____001_ ________
+        carry,
+        carry,
+        // ____0100 ________
+        carry | too_large,
+        // ____0101 ________ and up
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        // ____1101 ________
+        carry | too_large | too_large_1000 | surrogate,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000);
+
+    const __m256i byte_2_high_table = VIGOR_TABLE(
+        // ________ 0_______
+        too_short, too_short, too_short, too_short,
+        too_short, too_short, too_short, too_short,
+        // ________ 1000____
+        too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+        // ________ 1001____
+        too_long | overlong_2 | two_conts | overlong_3 | too_large,
+        // ________ 101_____
+        too_long | overlong_2 | two_conts | surrogate | too_large,
+        too_long | overlong_2 | two_conts | surrogate | too_large,
+        // ________ 11______
+        too_short, too_short, too_short, too_short);
+
+    __m256i prev1 = VIGOR_PREV(input, prev_input, 1);
+    __m256i special_cases = _mm256_and_si256(
+        _mm256_and_si256(
+            _mm256_shuffle_epi8(byte_1_high_table, high_nibbles(prev1)),
+            _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)))),
+        _mm256_shuffle_epi8(byte_2_high_table, high_nibbles(input)));
+
+    // Two bytes after a 3 or 4 byte lead, and three bytes after a 4 byte
+    // lead, there has to be a continuation byte. The lookups already flag
+    // every continuation byte that follows another one (two_conts), so
+    // these are exactly the places where that's expected.
+    __m256i prev2 = VIGOR_PREV(input, prev_input, 2);
+    __m256i prev3 = VIGOR_PREV(input, prev_input, 3);
+    __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80)));
+    __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80)));
+    __m256i must_be_continuation = _mm256_and_si256(
+        _mm256_or_si256(is_third_byte, is_fourth_byte),
+        _mm256_set1_epi8(char(0x80)));
+
+    return _mm256_xor_si256(must_be_continuation, special_cases);
+}
+
+// Nonzero if the block ends partway through a sequence
+VIGOR_TARGET_AVX2
+static inline __m256i is_incomplete(__m256i input) {
+    const __m256i max_value = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+
+    return _mm256_subs_epu8(input, max_value);
+}
+
+VIGOR_TARGET_AVX2
+static bool validate_utf8_avx2(const unsigned char *data, size_t length) {
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i < length) {
+        __m256i input;
+
+        if (i + 32 <= length) {
+            input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        } else {
+            // Padding the tail with zeroes (which are ASCII) still catches
+            // a sequence that gets cut off by the end of the data
+            alignas(32) unsigned char tail[32] = {0};
+            memcpy(tail, data + i, length - i);
+            input = _mm256_load_si256(reinterpret_cast<const __m256i*>(tail));
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            // Pure ASCII is always fine, as long as the last block didn't
+            // leave a sequence hanging
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = _mm256_setzero_si256();
+        } else {
+            error = _mm256_or_si256(error, check_utf8_block(input, prev_input));
+            prev_incomplete = is_incomplete(input);
+        }
+
+        prev_input = input;
+        i += 32;
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+
+    return _mm256_testz_si256(error, error);
+}
+
+#undef VIGOR_PREV
+#undef VIGOR_TABLE
+
+#endif
+
+bool is_ascii(const char *data, size_t length) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+
+#ifdef VIGOR_X86
+    if (has_avx2) {
+        return is_ascii_avx2(bytes, length);
+    }
+
+    return is_ascii_sse2(bytes, length);
+#else
+    return is_ascii_scalar(bytes, length);
+#endif
+}
+
+bool validate_utf8(const char *data, size_t length) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+
+#ifdef VIGOR_X86
+    if (has_avx2) {
+        return validate_utf8_avx2(bytes, length);
+    }
+#endif
+
+    return validate_utf8_scalar(bytes, length);
+}
+
+void encode_utf8(char32_t codepoint, std::string &out) {
+    if (codepoint < 0x80) {
+        out.push_back(char(codepoint));
+    } else if (codepoint < 0x800) {
+        out.push_back(char(0xC0 | (codepoint >> 6)));
+        out.push_back(char(0x80 | (codepoint & 0x3F)));
+    } else if (codepoint < 0x10000) {
+        // Surrogates can't be encoded, so they come out as the replacement
+        if (codepoint >= 0xD800 && codepoint <= 0xDFFF) {
+            codepoint = replacement_character;
+        }
+
+        out.push_back(char(0xE0 | (codepoint >> 12)));
+        out.push_back(char(0x80 | ((codepoint >> 6) & 0x3F)));
+        out.push_back(char(0x80 | (codepoint & 0x3F)));
+    } else if (codepoint <= 0x10FFFF) {
+        out.push_back(char(0xF0 | (codepoint >> 18)));
+        out.push_back(char(0x80 | ((codepoint >> 12) & 0x3F)));
+        out.push_back(char(0x80 | ((codepoint >> 6) & 0x3F)));
+        out.push_back(char(0x80 | (codepoint & 0x3F)));
+    } else {
+        encode_utf8(replacement_character, out);
+    }
+}
+
+size_t count_codepoints(const char *data, size_t length) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        char32_t cp;
+        size_t len = bytes[i] < 0x80 ? 1 : decode_one(bytes + i, length - i, cp);
+
+        // Invalid bytes are one replacement character each
+        i += len ? len : 1;
+        count++;
+    }
+
+    return count;
+}
+
+void decode_utf8(const char *data, size_t length, std::u32string &out) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+
+    // There's never more than one codepoint per byte
+    out.resize(length);
+
+    char32_t *dst = out.data();
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i < length) {
+        // Runs of ASCII get copied straight across, 32 bytes at a time
+        size_t ascii;
+
+#ifdef VIGOR_X86
+        if (has_avx2) {
+            ascii = widen_ascii_avx2(bytes + i, length - i, dst + count);
+        } else {
+            ascii = widen_ascii_sse2(bytes + i, length - i, dst + count);
+        }
+#else
+        ascii = widen_ascii_scalar(bytes + i, length - i, dst + count);
+#endif
+
+        i += ascii;
+        count += ascii;
+
+        if (i >= length) {
+            break;
+        }
+
+        // Then the multibyte sequence that stopped it
+        char32_t cp;
+        size_t len = decode_one(bytes + i, length - i, cp);
+
+        if (len == 0) {
+            cp = replacement_character;
+            len = 1;
+        }
+
+        dst[count++] = cp;
+        i += len;
+    }
+
+    out.resize(count);
+}
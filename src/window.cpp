@@ -72,6 +72,10 @@ void Window::global_key_event_callback(GLFWwindow *window, int key, int scancode
     }
 }
 
+void Window::global_char_event_callback(GLFWwindow *window, unsigned int codepoint) {
+    Window::engine->add_incoming_event({Char, {int(codepoint)}});
+}
+
 static void glfw_error_callback(int error, const char *description) {
     PLOGE << "Error: " << description;
 }
@@ -107,6 +111,7 @@ bool Window::startup() {
     }
 
     glfwSetKeyCallback(this->win, Window::global_key_event_callback);
+    glfwSetCharCallback(this->win, Window::global_char_event_callback);
     glfwSetCursorPosCallback(this->win, Window::global_cursor_pos_callback);
     glfwSetWindowSizeCallback(this->win, Window::global_window_size_callback);
 